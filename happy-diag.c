@@ -0,0 +1,135 @@
+/*
+ * happy-diag.c --
+ *
+ * Decode a diagnostics file written by happy (option -L). Every
+ * record is printed on a line of its own with its time stamp, the
+ * failed operation, the error and the endpoint it refers to.
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * See happy.c for the license terms.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "happy-diag.h"
+
+static const char *progname = "happy-diag";
+
+/*
+ * Find the line of the endpoint table describing endpoint id and
+ * return a pointer to the text following the id, or NULL.
+ */
+
+static const char *
+label(const char *names, uint32_t id, int *len)
+{
+    const char *p = names;
+    char *end;
+    unsigned long n;
+
+    while (p && *p) {
+        n = strtoul(p, &end, 10);
+        if (end != p && *end == ' ' && n == id) {
+            *len = strcspn(end + 1, "\n");
+            return end + 1;
+        }
+        p = strchr(p, '\n');
+        if (p) {
+            p++;
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+    FILE *in;
+    struct happy_diag_header hdr;
+    struct happy_diag rec;
+    char *names;
+    const char *lp;
+    char stamp[32];
+    struct tm *tm;
+    time_t t;
+    uint32_t i;
+    int len;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s file\n", progname);
+        exit(EXIT_FAILURE);
+    }
+
+    in = fopen(argv[1], "r");
+    if (! in) {
+        fprintf(stderr, "%s: %s: %s\n", progname, argv[1], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1
+        || memcmp(hdr.magic, HAPPY_DIAG_MAGIC, sizeof(hdr.magic)) != 0) {
+        fprintf(stderr, "%s: %s: not a happy diagnostics file\n",
+                progname, argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    if (hdr.order != HAPPY_DIAG_ORDER || hdr.version != HAPPY_DIAG_VERSION) {
+        fprintf(stderr, "%s: %s: unsupported byte order or version\n",
+                progname, argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    names = calloc(1, hdr.names_len + 1);
+    if (! names) {
+        fprintf(stderr, "%s: memory allocation failure\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    if (hdr.names_len && fread(names, hdr.names_len, 1, in) != 1) {
+        fprintf(stderr, "%s: %s: truncated file\n", progname, argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("# pid %lld, %llu records, %llu dropped\n",
+           (long long) hdr.pid, (unsigned long long) hdr.total,
+           (unsigned long long) (hdr.total - hdr.count));
+
+    for (i = 0; i < hdr.count; i++) {
+        if (fread(&rec, sizeof(rec), 1, in) != 1) {
+            fprintf(stderr, "%s: %s: truncated file\n", progname, argv[1]);
+            exit(EXIT_FAILURE);
+        }
+        t = rec.ts / 1000000;
+        tm = localtime(&t);
+        if (! tm || ! strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", tm)) {
+            snprintf(stamp, sizeof(stamp), "%lld", (long long) t);
+        }
+        printf("%s.%06d %s ", stamp, (int) (rec.ts % 1000000),
+               happy_diag_name(rec.code));
+        if (rec.code == HAPPY_DIAG_SIGNAL) {
+            printf("%s", strsignal(rec.value));
+        } else {
+            printf("%s", strerror(rec.err));
+        }
+        lp = NULL;
+        if (rec.id != HAPPY_DIAG_NOID) {
+            lp = label(names, rec.id, &len);
+        }
+        if (lp) {
+            printf(" (%.*s)", len, lp);
+        }
+        printf("\n");
+    }
+
+    free(names);
+    (void) fclose(in);
+    return EXIT_SUCCESS;
+}
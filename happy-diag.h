@@ -0,0 +1,69 @@
+/*
+ * happy-diag.h --
+ *
+ * Format of the diagnostic records happy keeps in an in-memory ring
+ * and writes to the file given with option -L when it exits, fails
+ * or is killed by a signal. The file starts with a header, followed
+ * by names_len bytes of text lines "id host port address" describing
+ * the endpoints and then count records, oldest first. All values are
+ * stored in the byte order of the host writing the file.
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * See happy.c for the license terms.
+ */
+
+#ifndef HAPPY_DIAG_H
+#define HAPPY_DIAG_H
+
+#include <stdint.h>
+
+#define HAPPY_DIAG_MAGIC	"HAPPYDG"
+#define HAPPY_DIAG_VERSION	1
+#define HAPPY_DIAG_ORDER	0x01020304
+
+#define HAPPY_DIAG_SOCKET	1	/* socket() failed */
+#define HAPPY_DIAG_FCNTL	2	/* fcntl(O_NONBLOCK) failed */
+#define HAPPY_DIAG_CONNECT	3	/* connect() failed immediately */
+#define HAPPY_DIAG_GETSOCKOPT	4	/* getsockopt(SO_ERROR) failed */
+#define HAPPY_DIAG_SELECT	5	/* select() failed */
+#define HAPPY_DIAG_RECV		6	/* recv() failed in pump */
+#define HAPPY_DIAG_SEND		7	/* send() failed in pump */
+#define HAPPY_DIAG_SIGNAL	8	/* fatal signal, value: signal */
+#define HAPPY_DIAG_MAX		8
+
+#define HAPPY_DIAG_NOID		0xffffffff	/* not related to an endpoint */
+
+struct happy_diag_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    int64_t pid;
+    uint64_t total;		/* records ever written, some overwritten */
+    uint32_t count;		/* records in the file */
+    uint32_t names_len;
+};
+
+struct happy_diag {
+    int64_t ts;			/* microseconds since the epoch */
+    uint32_t id;		/* endpoint id */
+    uint16_t code;		/* HAPPY_DIAG_* */
+    uint16_t pad;
+    int32_t err;		/* errno */
+    int32_t value;
+};
+
+static inline const char *
+happy_diag_name(unsigned int code)
+{
+    static const char *names[HAPPY_DIAG_MAX + 1] = {
+        "?", "socket", "fcntl", "connect", "getsockopt",
+        "select", "recv", "send", "signal"
+    };
+
+    return names[code <= HAPPY_DIAG_MAX ? code : 0];
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * happy-shm.h --
+ *
+ * Layout of the POSIX shared memory segment in which happy publishes
+ * live statistics of all endpoints while it is probing (option -S).
+ * The segment starts with a header followed by num_endpoints slots.
+ * Names and addresses in the slots are written once before the header
+ * magic is set and never change afterwards. The statistics of a slot
+ * are protected by a sequence counter: the writer increments seq
+ * before and after each update, so readers retry until they observe
+ * the same even seq value before and after copying a slot.
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * See happy.c for the license terms.
+ */
+
+#ifndef HAPPY_SHM_H
+#define HAPPY_SHM_H
+
+#include <stdint.h>
+
+#define HAPPY_SHM_MAGIC		0x48415059	/* "HAPY" */
+#define HAPPY_SHM_VERSION	1
+
+struct happy_shm_endpoint {
+    uint32_t seq;
+    uint32_t id;
+    int32_t family;
+    int32_t state;
+    char host[256];
+    char port[32];
+    char addr[48];
+
+    uint32_t attempts;		/* finished connection attempts */
+    uint32_t ok;
+    uint32_t failed;		/* SO_ERROR set, e.g. refused */
+    uint32_t timeouts;
+    int32_t last;		/* us, negative for failures */
+    uint32_t min;		/* us, successful attempts only */
+    uint32_t max;
+    uint32_t pad;
+    uint64_t sum;		/* us, successful attempts only */
+    int64_t updated;		/* us since the epoch */
+};
+
+struct happy_shm {
+    uint32_t magic;		/* set last, once the slots are valid */
+    uint32_t version;
+    uint32_t endpoint_size;	/* sizeof(struct happy_shm_endpoint) */
+    uint32_t num_endpoints;
+    int64_t pid;
+    int64_t started;		/* us since the epoch */
+    uint32_t round;		/* current round, counting from 1 */
+    uint32_t nqueries;
+    uint32_t done;		/* set when probing has finished */
+    uint32_t pad;
+    struct happy_shm_endpoint endpoints[];
+};
+
+#endif
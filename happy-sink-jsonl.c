@@ -0,0 +1,140 @@
+/*
+ * happy-sink-jsonl.c --
+ *
+ * Example output sink for happy. It writes every sample and every
+ * record as a JSON object on a line of its own. The optional argument
+ * names the output file; the default is standard output.
+ *
+ *     happy -s -o ./happy-sink-jsonl.so:/tmp/happy.jsonl www.ietf.org
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * See happy.c for the license terms.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "happy-sink.h"
+
+static FILE *out = NULL;
+
+static const char *
+kind(int k)
+{
+    switch (k) {
+    case HAPPY_RECORD_HAPPY:
+        return "happy";
+    case HAPPY_RECORD_PUMP:
+        return "pump";
+    case HAPPY_RECORD_DNS:
+        return "dns";
+    }
+    return "unknown";
+}
+
+/*
+ * Write a string as a JSON string literal or null.
+ */
+
+static void
+string(const char *s)
+{
+    if (! s) {
+        fputs("null", out);
+        return;
+    }
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(out, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            fprintf(out, "\\u%04x", *s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void
+sample(void *ctx, const struct happy_sample *sp)
+{
+    fprintf(out, "{\"type\":\"sample\",\"endpoint\":%u,\"host\":", sp->endpoint);
+    string(sp->host);
+    fputs(",\"port\":", out);
+    string(sp->port);
+    fprintf(out, ",\"family\":%d,\"status\":\"%s\",\"err\":%d,"
+            "\"timestamp\":%" PRId64 ",\"elapsed\":%u}\n",
+            sp->family,
+            sp->status == HAPPY_SAMPLE_TIMEOUT ? "timeout" : "done",
+            sp->err, sp->timestamp, sp->elapsed);
+}
+
+static void
+record(void *ctx, const struct happy_record *rp)
+{
+    unsigned int i;
+
+    fprintf(out, "{\"type\":\"%s\",\"timestamp\":%" PRId64 ",\"ok\":%s,"
+            "\"host\":", kind(rp->kind), rp->timestamp,
+            rp->ok ? "true" : "false");
+    string(rp->host);
+    fputs(",\"port\":", out);
+    string(rp->port);
+    fputs(",\"addr\":", out);
+    string(rp->addr);
+    switch (rp->kind) {
+    case HAPPY_RECORD_HAPPY:
+        fputs(",\"values\":[", out);
+        for (i = 0; i < rp->nvalues; i++) {
+            fprintf(out, "%s%d", i ? "," : "", rp->values[i]);
+        }
+        fputs("]", out);
+        break;
+    case HAPPY_RECORD_PUMP:
+        fprintf(out, ",\"sent\":%u,\"rcvd\":%u,\"duration\":%u",
+                rp->sent, rp->rcvd, rp->duration);
+        break;
+    case HAPPY_RECORD_DNS:
+        fputs(",\"canonname\":", out);
+        string(rp->canonname);
+        fputs(",\"reversename\":", out);
+        string(rp->reversename);
+        break;
+    }
+    fputs("}\n", out);
+}
+
+static void
+end(void *ctx)
+{
+    fflush(out);
+}
+
+static const struct happy_sink jsonl = {
+    .abi = HAPPY_SINK_ABI,
+    .name = "jsonl",
+    .sample = sample,
+    .record = record,
+    .end = end,
+};
+
+int
+happy_sink_init(const char *arg, happy_sink_register_t reg)
+{
+    out = stdout;
+    if (arg && *arg) {
+        out = fopen(arg, "a");
+        if (! out) {
+            perror(arg);
+            return -1;
+        }
+    }
+    /* happy may run continuously (-i), so do not sit on lines */
+    setvbuf(out, NULL, _IOLBF, 0);
+    return reg(&jsonl);
+}
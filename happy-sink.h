@@ -0,0 +1,87 @@
+/*
+ * happy-sink.h --
+ *
+ * Interface for output sinks that happy loads from shared objects at
+ * runtime (option -o). A sink module exports a single function named
+ * happy_sink_init, which happy calls once after loading the module:
+ *
+ *     int happy_sink_init(const char *arg, happy_sink_register_t reg);
+ *
+ * The arg is the text following the first ':' of the -o argument (or
+ * NULL). The function registers one or more sinks by calling reg and
+ * returns 0 on success or -1 if the module cannot be used. The sink
+ * structures passed to reg must remain valid until the program exits.
+ *
+ * Callbacks that are NULL are skipped. The begin callback is invoked
+ * once before probing starts, the sample callback for every finished
+ * connection attempt, the record callback for every line the built-in
+ * reports would produce and the end callback once after reporting.
+ * Pointers passed to callbacks are only valid during the call.
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * See happy.c for the license terms.
+ */
+
+#ifndef HAPPY_SINK_H
+#define HAPPY_SINK_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define HAPPY_SINK_ABI		1
+
+#define HAPPY_RECORD_HAPPY	1	/* connection establishment times */
+#define HAPPY_RECORD_PUMP	2	/* pump data rates */
+#define HAPPY_RECORD_DNS	3	/* name resolution details */
+
+#define HAPPY_SAMPLE_DONE	1	/* connect() finished, see err */
+#define HAPPY_SAMPLE_TIMEOUT	2	/* connect() timed out */
+
+struct happy_sample {
+    unsigned int endpoint;		/* endpoint id, unique per run */
+    const char *host;
+    const char *port;
+    const struct sockaddr *addr;
+    socklen_t addrlen;
+    int family;
+    int status;				/* HAPPY_SAMPLE_* */
+    int err;				/* SO_ERROR for HAPPY_SAMPLE_DONE */
+    int64_t timestamp;			/* microseconds since the epoch */
+    unsigned int elapsed;		/* microseconds */
+};
+
+struct happy_record {
+    int kind;				/* HAPPY_RECORD_* */
+    int64_t timestamp;			/* seconds since the epoch */
+    int ok;
+    const char *host;
+    const char *port;
+    const char *addr;			/* numeric, NULL if unresolved */
+    int family;
+    unsigned int nvalues;		/* HAPPY_RECORD_HAPPY */
+    const int *values;			/* us, negative for failures */
+    unsigned int sent;			/* HAPPY_RECORD_PUMP, bytes */
+    unsigned int rcvd;			/* HAPPY_RECORD_PUMP, bytes */
+    unsigned int duration;		/* HAPPY_RECORD_PUMP, ms */
+    const char *canonname;		/* HAPPY_RECORD_DNS, may be NULL */
+    const char *reversename;		/* HAPPY_RECORD_DNS, may be NULL */
+};
+
+struct happy_sink {
+    unsigned int abi;			/* must be HAPPY_SINK_ABI */
+    const char *name;
+    void *ctx;				/* passed to all callbacks */
+    void (*begin)(void *ctx);
+    void (*sample)(void *ctx, const struct happy_sample *sample);
+    void (*record)(void *ctx, const struct happy_record *record);
+    void (*end)(void *ctx);
+};
+
+typedef int (*happy_sink_register_t)(const struct happy_sink *sink);
+
+typedef int (*happy_sink_init_t)(const char *arg, happy_sink_register_t reg);
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * happy-top.c --
+ *
+ * Display the live statistics a running happy instance publishes in
+ * shared memory (happy option -S). The display is refreshed until
+ * interrupted; with -1 the statistics are printed once.
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * See happy.c for the license terms.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "happy-shm.h"
+
+static const char *progname = "happy-top";
+
+static struct happy_shm *shm = NULL;
+static size_t shm_size = 0;
+static ino_t shm_ino = 0;
+
+/*
+ * (Re)attach to the segment. A new happy run replaces the segment, so
+ * we check on every refresh whether the name refers to another object.
+ * Returns 0 if a valid segment is mapped.
+ */
+
+static int
+attach(const char *path)
+{
+    int fd;
+    struct stat st;
+    void *p;
+
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(*shm)) {
+        (void) close(fd);
+        return -1;
+    }
+    if (shm && st.st_ino == shm_ino && (size_t) st.st_size == shm_size) {
+        (void) close(fd);
+        return 0;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    (void) close(fd);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    if (shm) {
+        (void) munmap(shm, shm_size);
+    }
+    shm = p;
+    shm_size = st.st_size;
+    shm_ino = st.st_ino;
+    return 0;
+}
+
+/*
+ * Take a consistent copy of an endpoint slot.
+ */
+
+static void
+snapshot(const struct happy_shm_endpoint *slot,
+         struct happy_shm_endpoint *copy)
+{
+    uint32_t s1, s2;
+
+    do {
+        s1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        memcpy(copy, slot, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    } while ((s1 & 1) || s1 != s2);
+}
+
+static void
+ms(char *buf, size_t len, int64_t us)
+{
+    if (us < 0) {
+        snprintf(buf, len, "%9s", "*");
+    } else {
+        snprintf(buf, len, "%9.3f", us / 1000.0);
+    }
+}
+
+static void
+display(int once)
+{
+    uint32_t i, num;
+    struct happy_shm_endpoint ep;
+    struct timeval now;
+    char last[16], min[16], avg[16], max[16];
+    int running;
+
+    (void) gettimeofday(&now, NULL);
+    running = ! __atomic_load_n(&shm->done, __ATOMIC_ACQUIRE)
+        && (kill((pid_t) shm->pid, 0) == 0 || errno == EPERM);
+
+    if (! once) {
+        printf("\033[H\033[2J");
+    }
+    printf("happy pid %lld  %s  round %u/%u  %.1f s\n\n",
+           (long long) shm->pid, running ? "running" : "finished",
+           __atomic_load_n(&shm->round, __ATOMIC_RELAXED), shm->nqueries,
+           (now.tv_sec * 1000000LL + now.tv_usec - shm->started) / 1e6);
+    printf("%-24s %-5s %-39s %5s %5s %5s %5s %9s %9s %9s %9s\n",
+           "target", "port", "endpoint", "att", "ok", "fail", "tmo",
+           "last", "min", "avg", "max");
+
+    num = shm->num_endpoints;
+    if (sizeof(*shm) + (size_t) num * shm->endpoint_size > shm_size) {
+        return;
+    }
+    for (i = 0; i < num; i++) {
+        snapshot(&shm->endpoints[i], &ep);
+        ep.host[sizeof(ep.host) - 1] = 0;
+        ep.port[sizeof(ep.port) - 1] = 0;
+        ep.addr[sizeof(ep.addr) - 1] = 0;
+        ms(last, sizeof(last), ep.attempts ? ep.last : -1);
+        ms(min, sizeof(min), ep.ok ? (int64_t) ep.min : -1);
+        ms(avg, sizeof(avg), ep.ok ? (int64_t) (ep.sum / ep.ok) : -1);
+        ms(max, sizeof(max), ep.ok ? (int64_t) ep.max : -1);
+        printf("%-24.24s %-5.5s %-39.39s %5u %5u %5u %5u %s %s %s %s\n",
+               ep.host, ep.port, ep.addr, ep.attempts, ep.ok,
+               ep.failed, ep.timeouts, last, min, avg, max);
+    }
+    fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c, once = 0;
+    unsigned int interval = 1000;	/* in ms */
+    char *path;
+    struct timespec ts;
+
+    while ((c = getopt(argc, argv, "1hi:")) != -1) {
+        switch (c) {
+        case '1':
+            once = 1;
+            break;
+        case 'i':
+            {
+                char *endptr;
+                long num = strtol(optarg, &endptr, 10);
+                if (num > 0 && *endptr == '\0') {
+                    interval = num;
+                } else {
+                    fprintf(stderr, "%s: invalid argument '%s' "
+                            "for option -i\n", progname, optarg);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-1] [-i interval] name\n", progname);
+            exit(EXIT_FAILURE);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1) {
+        fprintf(stderr, "Usage: %s [-1] [-i interval] name\n", progname);
+        exit(EXIT_FAILURE);
+    }
+
+    path = malloc(strlen(argv[0]) + 2);
+    if (! path) {
+        fprintf(stderr, "%s: memory allocation failure\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    sprintf(path, "%s%s", (argv[0][0] == '/') ? "" : "/", argv[0]);
+
+    ts.tv_sec = interval / 1000;
+    ts.tv_nsec = (interval % 1000) * 1000000;
+
+    while (1) {
+        if (attach(path) == 0
+            && __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE)
+               == HAPPY_SHM_MAGIC) {
+            if (shm->version != HAPPY_SHM_VERSION
+                || shm->endpoint_size != sizeof(struct happy_shm_endpoint)) {
+                fprintf(stderr, "%s: %s: incompatible segment version\n",
+                        progname, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            display(once);
+            if (once) {
+                break;
+            }
+        } else if (once) {
+            fprintf(stderr, "%s: %s: no statistics available\n",
+                    progname, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        (void) nanosleep(&ts, NULL);
+    }
+
+    free(path);
+    return EXIT_SUCCESS;
+}
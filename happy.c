@@ -37,20 +37,27 @@
  */
 
 #define _POSIX_C_SOURCE 2
-#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
 #define _DARWIN_C_SOURCE
 #define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <time.h>
 #include <ctype.h>
+#include <limits.h>
+#include <math.h>
 #include <signal.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -59,14 +66,45 @@
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
 
+#include <dlfcn.h>
+
 #include <curl/curl.h>
 
+#include "happy-sink.h"
+#include "happy-shm.h"
+#include "happy-diag.h"
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/*
+ * USDT probes for bpftrace, perf or SystemTap. They compile to a nop
+ * instruction plus a note section and cost nothing unless a tracer
+ * attaches. Without sys/sdt.h they vanish entirely.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE2(name, a, b)		DTRACE_PROBE2(happy, name, a, b)
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3(happy, name, a, b, c)
+#define PROBE4(name, a, b, c, d)	DTRACE_PROBE4(happy, name, a, b, c, d)
+#else
+#define PROBE2(name, a, b)		do { } while (0)
+#define PROBE3(name, a, b, c)		do { } while (0)
+#define PROBE4(name, a, b, c, d)	do { } while (0)
+#endif
+
 static const char *progname = "happy";
 
 #ifndef NI_MAXHOST
@@ -83,6 +121,7 @@ static const char *progname = "happy";
 #define EP_STATE_FAILED		0x08
 
 typedef struct endpoint {
+    unsigned int id;
     int family;
     int socktype;
     int protocol;
@@ -103,14 +142,67 @@ typedef struct endpoint {
 
     unsigned int send;
     unsigned int rcvd;
+
+    struct happy_shm_endpoint *live;
+
+    double lat;				/* EWMA of the latency in us (-E) */
+    double loss;			/* EWMA of the failure ratio */
+    unsigned int samples;		/* attempts seen by the EWMAs */
+    int alerts;				/* HEALTH_* alerts raised */
+
+    double ref;				/* latency of the current regime (-K) */
+    double pos;				/* CUSUM of upward deviations */
+    double neg;				/* CUSUM of downward deviations */
+    unsigned int pos_n;			/* samples since pos was 0 */
+    unsigned int neg_n;
+    unsigned int warmup;		/* samples averaged into ref */
+    int shifted;			/* regime shift not yet reported */
+    double shift_from;			/* us */
+    double shift_to;
+
+    struct rollup *rollup;		/* history (-U), NULL if none yet */
+
+    int64_t cache_ts;			/* cached result last taken (-X) */
 } endpoint_t;
 
+/*
+ * Connection statistics of a target for the metrics endpoint, kept
+ * per address family (IPv4, IPv6). Bucket counts are not cumulative.
+ */
+
+#define METRICS_BUCKETS		12
+
+typedef struct tstats {
+    struct {
+        uint64_t buckets[METRICS_BUCKETS + 1];
+        uint64_t sum;		/* us, successful attempts only */
+        uint64_t ok;
+        uint64_t failed;
+        uint64_t timeouts;
+    } family[2];
+} tstats_t;
+
 typedef struct target {
+    unsigned int id;
     char *host;
     char *port;
     int num_endpoints;
     endpoint_t *endpoints;
+    tstats_t *stats;
+    int64_t expand_ts;		/* start of name resolution (us) */
+    int64_t expand_dur;
     struct target *next;
+    struct target *hnext;		/* next in the same index bucket */
+
+    int selected;			/* probed in this round (-F, -B) */
+    int probed;				/* probed in this run */
+    unsigned long last;			/* round last probed, from 1 */
+    double score;
+    unsigned int n;			/* latency mean and variance */
+    double mean;
+    double m2;
+    unsigned int every;			/* in ms, 0 for every run (-i) */
+    int64_t due;			/* next probe due (us) */
 } target_t;
 
 static target_t *targets = NULL;
@@ -127,6 +219,44 @@ static unsigned int delay = 25;		/* in ms */
 
 static int pump_timeout = 2000;		/* in ms */
 
+static unsigned int interval = 0;	/* in ms, continuous mode (-i) */
+static unsigned int jitter = 0;		/* in ms */
+
+static int rounds_done = 0;		/* rounds of the current run done */
+
+static char *ckpt_file = NULL;		/* checkpoint file (-k) */
+
+static int shard_lfd = -1;		/* coordinator socket (-D) */
+static int shard_fd = -1;		/* connection of a worker (-J) */
+
+static FILE *evlog = NULL;		/* raw event log (-w) */
+
+static struct happy_shm *live = NULL;	/* live statistics (-S) */
+
+static struct {
+    unsigned long rounds;
+    unsigned long connects;		/* connect() calls started */
+    unsigned long selects;		/* select() calls */
+    unsigned long scrapes;		/* metrics requests served */
+    unsigned long cached;		/* results taken from the cache */
+    int connecting;			/* pending connect() calls */
+} engine;
+
+static unsigned long allocs = 0;	/* allocations made by happy */
+
+static int append_fd = -1;		/* append file (-A) */
+static size_t append_batch = PIPE_BUF;	/* max. bytes per write() */
+
+#define SINK_MAX		16
+
+static const struct happy_sink *sinks[SINK_MAX];	/* loaded sinks (-o) */
+static int num_sinks = 0;
+
+static double fraction = 0;		/* of targets per round (-F) */
+
+static double rate = 0;			/* probe budget per second (-B) */
+static int classes = 0;			/* targets have their own intervals */
+
 static int target_valid(target_t *tp) {
     return (tp && tp->host && tp->port);
 }
@@ -135,6 +265,14 @@ static int endpoint_valid(endpoint_t *ep) {
     return (ep && ep->addrlen);
 }
 
+static int target_scheduled(void) {
+    return (fraction || (interval && (rate || classes)));
+}
+
+static int target_probed(target_t *tp) {
+    return ((! target_scheduled() && shard_lfd == -1) || tp->probed);
+}
+
 /*
  * A calloc() that exits if we run out of memory.
  */
@@ -147,6 +285,7 @@ xcalloc(size_t nmemb, size_t size)
         fprintf(stderr, "%s: memory allocation failure\n", progname);
         exit(EXIT_FAILURE);
     }
+    allocs++;
     return p;
 }
 
@@ -162,9 +301,159 @@ xrealloc(void *ptr, size_t size)
         fprintf(stderr, "%s: memory allocation failure\n", progname);
         exit(EXIT_FAILURE);
     }
+    allocs++;
+    return p;
+}
+
+/*
+ * A strdup() that exits if we run out of memory.
+ */
+
+static char*
+xstrdup(const char *s)
+{
+    char *p = strdup(s);
+    if (!p) {
+        fprintf(stderr, "%s: memory allocation failure\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    allocs++;
+    return p;
+}
+
+/*
+ * An asprintf() that exits if we run out of memory.
+ */
+
+static void
+xasprintf(char **strp, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vasprintf(strp, fmt, ap);
+    va_end(ap);
+    if (n == -1) {
+        fprintf(stderr, "%s: memory allocation failure\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    allocs++;
+}
+
+/*
+ * The measurement arrays of all endpoints are carved out of large
+ * blocks, so that setting up endpoints does not call calloc() for
+ * each of them. The blocks are only released all at once. Arrays of
+ * targets removed at runtime are put on a free list of their size
+ * class and handed out again by the next allocation of that size.
+ */
+
+#define POOL_BLOCK		(64 * 1024)
+
+typedef struct pool_block {
+    struct pool_block *next;
+    size_t size;
+    size_t used;
+    long long data[];
+} pool_block_t;
+
+typedef struct pool_chunk {
+    struct pool_chunk *next;
+} pool_chunk_t;
+
+typedef struct pool_class {
+    size_t size;
+    pool_chunk_t *spare;
+} pool_class_t;
+
+static pool_block_t *pool = NULL;
+static pool_class_t *pool_classes = NULL;
+static int pool_nclasses = 0;
+
+static pool_class_t*
+pool_class(size_t size)
+{
+    int i;
+
+    for (i = 0; i < pool_nclasses; i++) {
+        if (pool_classes[i].size == size) {
+            return &pool_classes[i];
+        }
+    }
+    return NULL;
+}
+
+static void*
+pool_alloc(size_t size)
+{
+    pool_block_t *bp;
+    pool_class_t *pc;
+    pool_chunk_t *cp;
+    size_t n;
+    void *p;
+
+    size = (size + sizeof(long long) - 1) & ~(sizeof(long long) - 1);
+    pc = pool_class(size);
+    if (pc && pc->spare) {
+        cp = pc->spare;
+        pc->spare = cp->next;
+        memset(cp, 0, size);
+        return cp;
+    }
+    if (! pool || pool->used + size > pool->size) {
+        n = size > POOL_BLOCK ? size : POOL_BLOCK;
+        bp = xcalloc(1, sizeof(*bp) + n);
+        bp->size = n;
+        bp->next = pool;
+        pool = bp;
+    }
+    p = (char *) pool->data + pool->used;
+    pool->used += size;
     return p;
 }
 
+/*
+ * Return a single array to the pool.
+ */
+
+static void
+pool_put(void *p, size_t size)
+{
+    pool_class_t *pc;
+    pool_chunk_t *cp = p;
+
+    if (! p) {
+        return;
+    }
+    size = (size + sizeof(long long) - 1) & ~(sizeof(long long) - 1);
+    pc = pool_class(size);
+    if (! pc) {
+        pool_classes = xrealloc(pool_classes,
+                                (pool_nclasses + 1) * sizeof(*pool_classes));
+        pc = &pool_classes[pool_nclasses++];
+        pc->size = size;
+        pc->spare = NULL;
+    }
+    cp->next = pc->spare;
+    pc->spare = cp;
+}
+
+static void
+pool_free(void)
+{
+    pool_block_t *bp;
+
+    while (pool) {
+        bp = pool->next;
+        free(pool);
+        pool = bp;
+    }
+    free(pool_classes);
+    pool_classes = NULL;
+    pool_nclasses = 0;
+}
+
 /*
  * Trim trailing and leading white space from a string. Note, this
  * version modifies the original string.
@@ -243,149 +532,3111 @@ unlock(FILE *f)
 }
 
 /*
- * Append a new target to our list of targets. We keep track of
- * the last target added so that we do not have to search for the
- * end of the list.
+ * Errors on the probing hot paths (socket(), connect(), recv() and
+ * friends) are not printed where they happen. They are recorded as
+ * fixed-size binary records in a ring that keeps the newest DIAG_SIZE
+ * records. The ring is written to the file given with -L when happy
+ * exits, also on fatal errors, or is killed by a signal; see
+ * happy-diag.h for the format and happy-diag for a decoder. Without
+ * -L the ring is decoded to stderr when happy exits and, in continuous
+ * mode (-i), after the reports of every run. Only the main thread
+ * records diagnostics.
+ */
+
+#define DIAG_SIZE		4096
+
+static struct {
+    struct happy_diag records[DIAG_SIZE];
+    uint64_t total;		/* records ever written */
+    uint64_t printed;		/* records decoded to stderr so far */
+    int fd;			/* diagnostics file (-L) or -1 */
+    char *names;		/* endpoint table, one line per endpoint */
+    size_t names_len;
+    size_t *labels;		/* endpoint id -> offset into names */
+    unsigned int num_labels;
+    volatile sig_atomic_t flushed;
+} diag = { .fd = -1 };
+
+/*
+ * Record a diagnostic for an endpoint (or NULL) with the current
+ * errno. The errno is preserved so that callers can still inspect it.
+ * This only uses async-signal-safe functions.
  */
 
 static void
-append(target_t *target)
+diag_record(int code, endpoint_t *ep, int value)
 {
-    static target_t *last_target = NULL;
+    int saved = errno;
+    struct timespec ts;
+    struct happy_diag *dp;
+
+    dp = &diag.records[diag.total % DIAG_SIZE];
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+    dp->ts = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    dp->id = ep ? ep->id : HAPPY_DIAG_NOID;
+    dp->code = code;
+    dp->pad = 0;
+    dp->err = saved;
+    dp->value = value;
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    diag.total++;
+    errno = saved;
+}
 
-    if (target) {
-        if (! targets) {
-            targets = target;
-        } else {
-            last_target->next = target;
+/*
+ * Build the endpoint table that goes with the records, so that the
+ * records can be decoded without the targets at hand. Lines have the
+ * form "id host port address". The table is rebuilt whenever the
+ * targets change.
+ */
+
+static void
+diag_begin(target_t *targets)
+{
+    target_t *tp;
+    endpoint_t *ep;
+    char addr[NI_MAXHOST], serv[NI_MAXSERV];
+    char *names = diag.names;
+    unsigned int i;
+    size_t size = 0;
+    FILE *f;
+
+    diag.names = NULL;
+    free(names);
+    for (i = 0; i < diag.num_labels; i++) {
+        diag.labels[i] = (size_t) -1;
+    }
+
+    f = open_memstream(&names, &size);
+    if (! f) {
+        fprintf(stderr, "%s: open_memstream: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (ep->id >= diag.num_labels) {
+                diag.labels = xrealloc(diag.labels,
+                                       (ep->id + 1) * sizeof(size_t));
+                while (diag.num_labels <= ep->id) {
+                    diag.labels[diag.num_labels++] = (size_t) -1;
+                }
+            }
+            if (getnameinfo((struct sockaddr *) &ep->addr, ep->addrlen,
+                            addr, sizeof(addr), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+                snprintf(addr, sizeof(addr), "?");
+            }
+            fprintf(f, "%u ", ep->id);
+            diag.labels[ep->id] = ftell(f);
+            fprintf(f, "%s %s %s\n", tp->host, tp->port, addr);
         }
-        last_target = target;
+    }
+    if (fclose(f) == EOF) {
+        fprintf(stderr, "%s: fclose: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    diag.names_len = size;
+    diag.names = names;
+}
+
+static void
+diag_write(const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(diag.fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        p += n;
+        len -= n;
     }
 }
 
 /*
- * Handler to parse DNS response messages; particularly CNAME
- * answers. This is used because getaddrinfo(...) and AI_CANONNAME
- * cannot be used with the glibc version on SamKnows probes. The
- * version returns PTR entries when asked for a CNAME. Therefore
- * explicit CNAME query request needs to be made and a handler
- * function is needed to parse CNAME responses.
+ * Write the ring to the diagnostics file. This happens at most once
+ * and only uses async-signal-safe functions, so it can be called from
+ * the handler of a fatal signal.
  */
 
-static char*
-parse_cname_response(const u_char* const answer, const int answerlen)
+static void
+diag_flush(void)
 {
+    struct happy_diag_header hdr;
+    uint64_t total = diag.total;
+    uint32_t count = total < DIAG_SIZE ? total : DIAG_SIZE;
+    uint32_t first = (total - count) % DIAG_SIZE;
 
-    /* initialize data structure to store the parsed response */
-    ns_msg handle;
-    if (
-	ns_initparse(
-	    answer,     /* answer buffer */
-	    answerlen,  /* true answer length */
-	    &handle     /* data structure filled in by ns_initparse */
-	    ) < 0
-	) {
-	herror("ns_initparse(...)");
-	exit(EXIT_FAILURE);
+    if (diag.fd == -1 || diag.flushed) {
+        return;
     }
-    
-    /* Ideally one would iterate over each resource record returned by
-     * ns_msg_count(...). However, this is a specific parse function for CNAME
-     * records and because a RR cannot have any other records along with a
-     * CNAME [RFC 1912], there is no need to iterate in a loop, but only once,
-     * therefore rrnum is set to 0 */
-    
-    ns_rr rr; int rrnum = 0;
-    
-    /* parse the answer section of the resource record */
-    if (
-	ns_parserr(
-	    &handle, /* data structure filled by ns_initparse */
-	    ns_s_an, /* resource record answer section */
-	    rrnum,   /* resource record index in this section */
-	    &rr      /* data structure filled in by ns_parseerr */
-	    ) < 0
-	) {
-	
-	/* continue to the next resource records if this cannot be parsed */
-	if (errno != ENODEV) {
-	    herror("ns_parserr(...)");
-	    exit(EXIT_FAILURE);
-	}
+    diag.flushed = 1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, HAPPY_DIAG_MAGIC, sizeof(hdr.magic));
+    hdr.version = HAPPY_DIAG_VERSION;
+    hdr.order = HAPPY_DIAG_ORDER;
+    hdr.pid = getpid();
+    hdr.total = total;
+    hdr.count = count;
+    hdr.names_len = diag.names ? diag.names_len : 0;
+
+    diag_write(&hdr, sizeof(hdr));
+    if (hdr.names_len) {
+        diag_write(diag.names, hdr.names_len);
     }
-    
-    char* dst = NULL;
-    switch (ns_rr_type(rr)) {
-	
-	/* type: CNAME record */
-    case ns_t_cname:
-	dst = (char *) xcalloc (1, NI_MAXHOST);
-	
-	/* Uncompress the DNS string */
-	if (
-	    ns_name_uncompress(
-		ns_msg_base(handle) /* Message Start */
-		, ns_msg_end(handle)  /* Message End */
-		, ns_rr_rdata(rr)     /* Message Position */
-		, dst                 /* Result */
-		, NI_MAXHOST          /* Result Size */
-		) < 0
-	    ) {
-	    (void) fprintf(stderr, "ns_name_uncompress failed\n");
-	    free(dst); dst = NULL;
-	    exit(EXIT_FAILURE);
-	}
-	
-	break;
-	
-	/* ignore all the other types */
-    default:
-	break;
+    if (first + count > DIAG_SIZE) {
+        diag_write(&diag.records[first],
+                   (DIAG_SIZE - first) * sizeof(struct happy_diag));
+        diag_write(&diag.records[0],
+                   (first + count - DIAG_SIZE) * sizeof(struct happy_diag));
+    } else {
+        diag_write(&diag.records[first], count * sizeof(struct happy_diag));
     }
-    
-    return dst;
+    (void) close(diag.fd);
 }
 
 /*
- * Resolve the host and port name and if successful establish a new
- * target and create the vector of endpoints we are going to probe
- * subsequently.
+ * Give up after a fatal error on the hot path. The error is reported
+ * on stderr right away only if the ring goes to a file; otherwise the
+ * ring is decoded to stderr on exit anyway.
  */
 
-static target_t*
-expand(const char *host, const char *port)
+static void
+diag_die(int code, endpoint_t *ep)
 {
-    struct addrinfo hints, *ai_list, *ai;
-    char* canonname = NULL;
-    int n;
-    target_t *tp;
-    endpoint_t *ep;
+    diag_record(code, ep, 0);
+    if (diag.fd != -1) {
+        fprintf(stderr, "%s: %s: %s\n",
+                progname, happy_diag_name(code), strerror(errno));
+    }
+    exit(EXIT_FAILURE);
+}
 
-    assert(host && port);
+static void
+diag_fatal(int sig)
+{
+    diag_record(HAPPY_DIAG_SIGNAL, NULL, sig);
+    diag_flush();
+    (void) raise(sig);	/* SA_RESETHAND restored the default action */
+}
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    if (dmode) {
-	
-	/*  In order to get the CNAME, one can set the AI_CANONNAME
-	 *  flag in hints.ai_flags. However it appears glibc tends to
-	 *  return PTR entries when this flag is turned on (see:
-	 *  http://marc.info/?l=glibc-alpha&m=109239199429843&w=2). The
-	 *  newer versions of glibc have been patched, however the
-	 *  version running on SamKnows probes still has this
-	 *  behavior. As a workaround, we use BIND functions to
-	 *  explicitly send a CNAME query and parse the DNS response
-	 *  ourselves. The answer string is then plugged back into the
-	 *  result structures used below.
-	 */
+/*
+ * Decode the records not yet printed to stderr, used if there is no -L
+ * file.
+ */
 
-	/* hints.ai_flags |= AI_CANONNAME; */
+static void
+diag_print(void)
+{
+    uint64_t i;
+    struct happy_diag *dp;
+    const char *label;
 
-	/* list to keep a chain of CNAME strings */
-	short dstset_num = 0;
-	char** dstset = NULL;
-	const char* query_name = host;
+    i = diag.total > DIAG_SIZE ? diag.total - DIAG_SIZE : 0;
+    if (i < diag.printed) {
+        i = diag.printed;
+    }
+    if (i > diag.printed) {
+        fprintf(stderr, "%s: %llu older diagnostics dropped\n",
+                progname, (unsigned long long) (i - diag.printed));
+    }
+    for (; i < diag.total; i++) {
+        dp = &diag.records[i % DIAG_SIZE];
+        label = NULL;
+        if (dp->id < diag.num_labels && diag.labels[dp->id] != (size_t) -1) {
+            label = diag.names + diag.labels[dp->id];
+        }
+        if (label) {
+            fprintf(stderr, "%s: %s: %s (%.*s)\n", progname,
+                    happy_diag_name(dp->code), strerror(dp->err),
+                    (int) strcspn(label, "\n"), label);
+        } else {
+            fprintf(stderr, "%s: %s: %s\n", progname,
+                    happy_diag_name(dp->code), strerror(dp->err));
+        }
+    }
+    diag.printed = diag.total;
+}
+
+static void
+diag_exit(void)
+{
+    if (diag.fd != -1) {
+        diag_flush();
+    } else {
+        diag_print();
+    }
+}
+
+/*
+ * Open the diagnostics file and arrange for the ring to be written
+ * when happy exits or dies from a signal.
+ */
+
+static void
+diag_open(const char *filename)
+{
+    static const int signals[] = {
+        SIGHUP, SIGQUIT, SIGILL, SIGABRT, SIGFPE, SIGSEGV, SIGBUS, 0
+    };
+    struct sigaction sa;
+    int i;
+
+    if (diag.fd != -1) {
+        (void) close(diag.fd);
+    }
+    diag.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (diag.fd == -1) {
+        fprintf(stderr, "%s: %s: %s\n", progname, filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = diag_fatal;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    for (i = 0; signals[i]; i++) {
+        (void) sigaction(signals[i], &sa, NULL);
+    }
+}
+
+/*
+ * SIGINT and SIGTERM stop a run gracefully: no new connection attempts
+ * are started, attempts in flight get at most STOP_GRACE milliseconds
+ * to finish and the results measured so far are reported as usual. A
+ * second signal terminates happy right away. SIGUSR1 asks for a dump
+ * of the current statistics on standard error, which happens at the
+ * next round boundary (or right away between runs) without stopping.
+ */
+
+#define STOP_GRACE		1000	/* in ms */
+
+static volatile sig_atomic_t stopping = 0;
+static volatile sig_atomic_t dumping = 0;
+
+static void
+on_signal(int sig)
+{
+    if (sig == SIGUSR1) {
+        dumping = 1;
+        return;
+    }
+    if (stopping) {
+        (void) signal(sig, SIG_DFL);
+        diag_fatal(sig);
+    }
+    stopping = 1;
+}
+
+static void
+signals_begin(void)
+{
+    static const int signals[] = { SIGINT, SIGTERM, SIGUSR1, 0 };
+    struct sigaction sa;
+    int i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    for (i = 0; signals[i]; i++) {
+        (void) sigaction(signals[i], &sa, NULL);
+    }
+}
+
+/*
+ * Self-profiling (-P). Wall clock time, CPU time of the main thread
+ * and the number of system calls happy issues itself are accounted to
+ * the phase that is currently active. Phases nest: entering a phase
+ * suspends the accounting of the enclosing phase until the inner
+ * phase is left, so every phase reports its own share only. Time
+ * outside of any phase is accounted to "other". System calls and
+ * memory allocations made inside libraries (resolver, curl, stdio)
+ * are not counted, only those of happy itself.
+ */
+
+#define PH_OTHER		0
+#define PH_CURL			1	/* curl startup probe */
+#define PH_EXPAND		2	/* name resolution */
+#define PH_REVERSE		3	/* reverse lookups (-a) */
+#define PH_PACING		4	/* naps between connect() calls */
+#define PH_PREPARE		5	/* starting connect() calls */
+#define PH_COLLECT		6
+#define PH_PUMP			7
+#define PH_SORT			8
+#define PH_REPORT_DNS		9
+#define PH_REPORT		10
+#define PH_REPORT_PUMP		11
+#define PH_REPORT_SINKS		12
+#define PH_MAX			13
+
+#define PROF_DEPTH		8
+
+static const char *prof_names[PH_MAX] = {
+    "other", "curl", "expand", "reverse", "pacing", "prepare", "collect",
+    "pump", "sort", "report_dns", "report", "report_pump", "report_sinks"
+};
+
+static struct {
+    int enabled;
+    struct {
+        unsigned long calls;
+        unsigned long syscalls;
+        unsigned long allocs;
+        int64_t wall;			/* us */
+        int64_t cpu;			/* us */
+    } phase[PH_MAX];
+    int stack[PROF_DEPTH];
+    int depth;
+    int64_t wall, cpu;			/* start of the current slice */
+    unsigned long syscalls;		/* issued so far */
+    unsigned long mark;			/* syscalls at slice start */
+    unsigned long amark;		/* allocs at slice start */
+} prof;
+
+/*
+ * Count a system call issued by happy itself for the profile.
+ */
+
+#define SYS(call)	(prof.syscalls++, (call))
+
+static int64_t
+prof_clock(clockid_t id)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(id, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Hardware performance counters for the profile (-H). The counters
+ * are opened as one perf event group for the main thread and read
+ * whenever a profile slice ends, so they are accounted to the phases
+ * like the times above. Counters the kernel or the hardware does not
+ * provide are left out; if perf_event_paranoid forbids counting in
+ * the kernel, only user space is counted.
+ */
+
+#define PC_INSTRUCTIONS		0
+#define PC_CYCLES		1
+#define PC_CACHE_MISSES		2
+#define PC_CSWITCHES		3
+#define PC_MAX			4
+
+static struct {
+    int fd;				/* group leader or -1 */
+    int num;				/* counters in the group */
+    int user;				/* user space only */
+    int index[PC_MAX];			/* position in the group or -1 */
+    uint64_t last[PC_MAX];
+    uint64_t phase[PH_MAX][PC_MAX];
+} pc = { .fd = -1 };
+
+static int
+pc_read(uint64_t *values)
+{
+    uint64_t buf[1 + PC_MAX];
+    int i;
+
+    if (pc.fd == -1 || read(pc.fd, buf, sizeof(buf)) <= 0) {
+        return -1;
+    }
+    for (i = 0; i < PC_MAX; i++) {
+        values[i] = pc.index[i] == -1 ? 0 : buf[1 + pc.index[i]];
+    }
+    return 0;
+}
+
+static void
+pc_slice(int ph)
+{
+    uint64_t values[PC_MAX];
+    int i;
+
+    if (pc_read(values) == -1) {
+        return;
+    }
+    for (i = 0; i < PC_MAX; i++) {
+        pc.phase[ph][i] += values[i] - pc.last[i];
+        pc.last[i] = values[i];
+    }
+}
+
+static void
+pc_open(void)
+{
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[PC_MAX] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    };
+    struct perf_event_attr attr;
+    int i, fd, err = 0;
+
+    if (pc.fd != -1) {
+        return;
+    }
+    for (i = 0; i < PC_MAX; i++) {
+        pc.index[i] = -1;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_hv = 1;
+        attr.exclude_kernel = pc.user;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, pc.fd,
+                     PERF_FLAG_FD_CLOEXEC);
+        if (fd == -1 && ! pc.user && (errno == EACCES || errno == EPERM)) {
+            pc.user = attr.exclude_kernel = 1;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, pc.fd,
+                         PERF_FLAG_FD_CLOEXEC);
+        }
+        if (fd == -1) {
+            err = errno;
+            continue;
+        }
+        if (pc.fd == -1) {
+            pc.fd = fd;
+        }
+        pc.index[i] = pc.num++;
+    }
+    if (pc.fd == -1) {
+        fprintf(stderr, "%s: perf_event_open: %s (no counters)\n",
+                progname, strerror(err));
+        return;
+    }
+    (void) pc_read(pc.last);
+#else
+    fprintf(stderr, "%s: performance counters not supported\n", progname);
+#endif
+}
+
+/*
+ * Close the current slice and account it to the active phase.
+ */
+
+static void
+prof_slice(void)
+{
+    int64_t wall = prof_clock(CLOCK_MONOTONIC);
+    int64_t cpu = prof_clock(CLOCK_THREAD_CPUTIME_ID);
+    int ph = prof.stack[prof.depth];
+
+    prof.phase[ph].wall += wall - prof.wall;
+    prof.phase[ph].cpu += cpu - prof.cpu;
+    prof.phase[ph].syscalls += prof.syscalls - prof.mark;
+    prof.phase[ph].allocs += allocs - prof.amark;
+    pc_slice(ph);
+    prof.wall = wall;
+    prof.cpu = cpu;
+    prof.mark = prof.syscalls;
+    prof.amark = allocs;
+}
+
+static void
+prof_enter(int ph)
+{
+    if (! prof.enabled) {
+        return;
+    }
+    prof_slice();
+    assert(prof.depth + 1 < PROF_DEPTH);
+    prof.stack[++prof.depth] = ph;
+    prof.phase[ph].calls++;
+}
+
+static void
+prof_leave(void)
+{
+    if (! prof.enabled) {
+        return;
+    }
+    prof_slice();
+    assert(prof.depth > 0);
+    prof.depth--;
+}
+
+static void
+prof_begin(void)
+{
+    if (prof.enabled) {
+        return;
+    }
+    prof.enabled = 1;
+    prof.wall = prof_clock(CLOCK_MONOTONIC);
+    prof.cpu = prof_clock(CLOCK_THREAD_CPUTIME_ID);
+    prof.mark = prof.syscalls;
+    prof.amark = allocs;
+}
+
+/*
+ * Print the profile as a table followed by a single PROFILE record
+ * in the semicolon separated style of -m, with one comma separated
+ * group "phase,calls,wall,cpu,syscalls,allocs" per phase (times in
+ * us).
+ */
+
+static void
+prof_report(FILE *out)
+{
+    int i;
+    int64_t wall = 0, cpu = 0;
+    unsigned long syscalls = 0, nallocs = 0;
+
+    if (! prof.enabled) {
+        return;
+    }
+    prof_slice();
+
+    for (i = 0; i < PH_MAX; i++) {
+        wall += prof.phase[i].wall;
+        cpu += prof.phase[i].cpu;
+        syscalls += prof.phase[i].syscalls;
+        nallocs += prof.phase[i].allocs;
+    }
+
+    fprintf(out, "\n%-14s %8s %12s %6s %12s %9s %7s\n",
+            "phase", "calls", "wall [ms]", "wall%", "cpu [ms]", "syscalls",
+            "allocs");
+    for (i = 0; i < PH_MAX; i++) {
+        if (! prof.phase[i].calls && i != PH_OTHER) {
+            continue;
+        }
+        fprintf(out, "%-14s %8lu %12.3f %5.1f%% %12.3f %9lu %7lu\n",
+                prof_names[i], prof.phase[i].calls,
+                prof.phase[i].wall / 1000.0,
+                wall ? 100.0 * prof.phase[i].wall / wall : 0.0,
+                prof.phase[i].cpu / 1000.0, prof.phase[i].syscalls,
+                prof.phase[i].allocs);
+    }
+    fprintf(out, "%-14s %8s %12.3f %5.1f%% %12.3f %9lu %7lu\n",
+            "total", "", wall / 1000.0, 100.0, cpu / 1000.0, syscalls,
+            nallocs);
+
+    fprintf(out, "PROFILE.0.4;%lu", (unsigned long) time(NULL));
+    for (i = 0; i < PH_MAX; i++) {
+        fprintf(out, ";%s,%lu,%lld,%lld,%lu,%lu", prof_names[i],
+                prof.phase[i].calls, (long long) prof.phase[i].wall,
+                (long long) prof.phase[i].cpu, prof.phase[i].syscalls,
+                prof.phase[i].allocs);
+    }
+    fprintf(out, "\n");
+}
+
+/*
+ * Print the counters per phase, normalized per connection attempt for
+ * the probing phases and per endpoint for all others, followed by a
+ * single PERF record with the raw counts (-1 if not available).
+ */
+
+static void
+pc_report(FILE *out)
+{
+    static const char *names[PC_MAX] = {
+        "instructions", "cycles", "cache-misses", "ctx-switches"
+    };
+    target_t *tp;
+    unsigned long endpoints = 0, n;
+    uint64_t *v;
+    int i, k;
+
+    if (pc.fd == -1) {
+        return;
+    }
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        endpoints += tp->num_endpoints;
+    }
+
+    fprintf(out, "\n%-14s", "phase");
+    for (k = 0; k < PC_MAX; k++) {
+        fprintf(out, " %12s", names[k]);
+    }
+    fprintf(out, " %5s %-9s %10s %10s\n", "IPC", "per", "insns", "cycles");
+    for (i = 0; i < PH_MAX; i++) {
+        if (! prof.phase[i].calls && i != PH_OTHER) {
+            continue;
+        }
+        v = pc.phase[i];
+        fprintf(out, "%-14s", prof_names[i]);
+        for (k = 0; k < PC_MAX; k++) {
+            if (pc.index[k] == -1) {
+                fprintf(out, " %12s", "n/a");
+            } else {
+                fprintf(out, " %12llu", (unsigned long long) v[k]);
+            }
+        }
+        if (v[PC_CYCLES]) {
+            fprintf(out, " %5.2f",
+                    (double) v[PC_INSTRUCTIONS] / v[PC_CYCLES]);
+        } else {
+            fprintf(out, " %5s", "-");
+        }
+        if (i == PH_PACING || i == PH_PREPARE || i == PH_COLLECT) {
+            n = engine.connects;
+            fprintf(out, " %-9s", "probe");
+        } else {
+            n = endpoints;
+            fprintf(out, " %-9s", "endpoint");
+        }
+        if (n && pc.index[PC_INSTRUCTIONS] != -1
+            && pc.index[PC_CYCLES] != -1) {
+            fprintf(out, " %10.0f %10.0f\n",
+                    (double) v[PC_INSTRUCTIONS] / n,
+                    (double) v[PC_CYCLES] / n);
+        } else {
+            fprintf(out, " %10s %10s\n", "-", "-");
+        }
+    }
+    if (pc.user) {
+        fprintf(out, "(user space only, see perf_event_paranoid)\n");
+    }
+
+    fprintf(out, "PERF.0.4;%lu;%lu;%lu;%d", (unsigned long) time(NULL),
+            engine.connects, endpoints, ! pc.user);
+    for (i = 0; i < PH_MAX; i++) {
+        fprintf(out, ";%s", prof_names[i]);
+        for (k = 0; k < PC_MAX; k++) {
+            if (pc.index[k] == -1) {
+                fprintf(out, ",-1");
+            } else {
+                fprintf(out, ",%llu", (unsigned long long) pc.phase[i][k]);
+            }
+        }
+    }
+    fprintf(out, "\n");
+}
+
+/*
+ * The raw event log records what happened during a run so that the
+ * results can be reported again later without probing (see replay()).
+ * The log starts with a header carrying the parameters of the run,
+ * followed by definition records for all targets and endpoints and
+ * then a stream of fixed-size event records. Definition records are
+ * followed by a payload of len bytes. All values are stored in the
+ * byte order of the host writing the log.
+ */
+
+#define EVLOG_MAGIC		"HAPPYEV"
+#define EVLOG_VERSION		1
+#define EVLOG_ORDER		0x01020304
+
+#define EV_TARGET		0x01	/* payload: host\0port\0 */
+#define EV_ENDPOINT		0x02	/* payload: sockaddr, canon\0rev\0 */
+					/* value: target id, err: addrlen */
+#define EV_ROUND		0x03	/* value: round number */
+#define EV_CONNECT		0x04	/* connect() started */
+#define EV_DONE			0x05	/* value: us, err: SO_ERROR */
+#define EV_TIMEOUT		0x06	/* value: us */
+#define EV_FAIL			0x07	/* err: errno of socket()/connect() */
+#define EV_SENT			0x08	/* value: bytes sent by pump() */
+#define EV_RCVD			0x09	/* value: bytes received by pump() */
+#define EV_SPAN			0x0a	/* trace only, never logged */
+
+typedef struct evlog_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint32_t nqueries;
+    uint32_t timeout;
+    uint32_t delay;
+    uint32_t pump_timeout;
+} evlog_header_t;
+
+typedef struct evlog_event {
+    uint8_t type;
+    uint8_t family;
+    uint16_t len;		/* length of the trailing payload */
+    uint32_t id;		/* target or endpoint id */
+    int64_t ts;			/* microseconds since the epoch */
+    int32_t value;
+    int32_t err;
+} evlog_event_t;
+
+static int64_t
+tv2us(const struct timeval *tv)
+{
+    return (int64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static void
+evlog_write(const void *buf, size_t len)
+{
+    if (fwrite(buf, 1, len, evlog) != len) {
+        fprintf(stderr, "%s: event log: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Write the definition records of a target and its endpoints.
+ */
+
+static void
+evlog_target(target_t *tp)
+{
+    evlog_event_t ev;
+    endpoint_t *ep;
+    const char *canon, *rev;
+    struct timeval now;
+
+    if (! evlog) {
+        return;
+    }
+
+    (void) gettimeofday(&now, NULL);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.type = EV_TARGET;
+    ev.id = tp->id;
+    ev.ts = tv2us(&now);
+    ev.len = strlen(tp->host) + 1 + strlen(tp->port) + 1;
+    evlog_write(&ev, sizeof(ev));
+    evlog_write(tp->host, strlen(tp->host) + 1);
+    evlog_write(tp->port, strlen(tp->port) + 1);
+
+    for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+        canon = ep->canonname ? ep->canonname : "";
+        rev = ep->reversename ? ep->reversename : "";
+        memset(&ev, 0, sizeof(ev));
+        ev.type = EV_ENDPOINT;
+        ev.family = ep->family;
+        ev.id = ep->id;
+        ev.ts = tv2us(&now);
+        ev.value = tp->id;
+        ev.err = ep->addrlen;
+        ev.len = ep->addrlen + strlen(canon) + 1 + strlen(rev) + 1;
+        evlog_write(&ev, sizeof(ev));
+        evlog_write(&ep->addr, ep->addrlen);
+        evlog_write(canon, strlen(canon) + 1);
+        evlog_write(rev, strlen(rev) + 1);
+    }
+}
+
+/*
+ * Write the header and the definitions of all targets and endpoints
+ * into the raw event log. This is done once right before probing
+ * starts, when all targets have been expanded.
+ */
+
+static void
+evlog_begin(target_t *targets)
+{
+    evlog_header_t hdr;
+    target_t *tp;
+
+    if (! evlog) {
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, EVLOG_MAGIC, sizeof(EVLOG_MAGIC));
+    hdr.version = EVLOG_VERSION;
+    hdr.order = EVLOG_ORDER;
+    hdr.nqueries = nqueries;
+    hdr.timeout = timeout;
+    hdr.delay = delay;
+    hdr.pump_timeout = pump_timeout;
+    evlog_write(&hdr, sizeof(hdr));
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        evlog_target(tp);
+    }
+}
+
+static void
+evlog_end(void)
+{
+    if (evlog && fclose(evlog) == EOF) {
+        fprintf(stderr, "%s: event log: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    evlog = NULL;
+}
+
+/*
+ * Trace export (-T). Writes the Chrome trace event format (JSON),
+ * which can be loaded into Perfetto or chrome://tracing. The happy
+ * process itself is shown as pid 1 with a track for the main thread
+ * (name resolution, pacing naps, rounds, sorting, reports) and one for
+ * the writer thread. Every target is shown as a process of its own
+ * with a track per endpoint carrying the connection attempts and pump
+ * sessions. Timestamps are microseconds since the program started.
+ */
+
+#define TRACE_PID		1
+#define TRACE_TID_MAIN		1
+#define TRACE_TID_WRITER	2
+
+static FILE *trace = NULL;
+static int trace_count = 0;
+static int64_t trace_t0 = 0;
+
+static int64_t
+now_us(void)
+{
+    struct timeval tv;
+
+    (void) gettimeofday(&tv, NULL);
+    return tv2us(&tv);
+}
+
+static void
+trace_string(const char *s)
+{
+    fputc('"', trace);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(trace, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            fprintf(trace, "\\u%04x", *s);
+        } else {
+            fputc(*s, trace);
+        }
+    }
+    fputc('"', trace);
+}
+
+/*
+ * Write a complete event (a span) or, if dur is negative, an instant
+ * event. The args are a JSON object or NULL.
+ */
+
+static void
+trace_span(int pid, int tid, const char *name, int64_t ts, int64_t dur,
+           const char *args)
+{
+    fprintf(trace, "%s{\"name\":", trace_count++ ? ",\n" : "");
+    trace_string(name);
+    if (dur >= 0) {
+        fprintf(trace, ",\"ph\":\"X\",\"dur\":%lld", (long long) dur);
+    } else {
+        fprintf(trace, ",\"ph\":\"i\",\"s\":\"t\"");
+    }
+    fprintf(trace, ",\"pid\":%d,\"tid\":%d,\"ts\":%lld",
+            pid, tid, (long long) (ts - trace_t0));
+    if (args) {
+        fprintf(trace, ",\"args\":%s", args);
+    }
+    fputc('}', trace);
+}
+
+static void
+trace_meta(const char *what, int pid, int tid, const char *name)
+{
+    fprintf(trace, "%s{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":",
+            trace_count++ ? ",\n" : "", what, pid, tid);
+    trace_string(name);
+    fputs("}}", trace);
+}
+
+static void
+trace_open(const char *filename)
+{
+    if (trace) {
+        (void) fclose(trace);
+    }
+    trace = fopen(filename, "w");
+    if (! trace) {
+        fprintf(stderr, "%s: fopen: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", trace);
+}
+
+/*
+ * Name all tracks and write the name resolution spans recorded by
+ * expand() for all targets.
+ */
+
+static void
+trace_begin(target_t *targets)
+{
+    target_t *tp;
+    endpoint_t *ep;
+    char name[NI_MAXHOST + NI_MAXSERV + 16], args[64];
+    char serv[NI_MAXSERV];
+
+    if (! trace) {
+        return;
+    }
+
+    trace_meta("process_name", TRACE_PID, TRACE_TID_MAIN, progname);
+    trace_meta("thread_name", TRACE_PID, TRACE_TID_MAIN, "main");
+    trace_meta("thread_name", TRACE_PID, TRACE_TID_WRITER, "writer");
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        snprintf(name, sizeof(name), "%s:%s", tp->host, tp->port);
+        trace_meta("process_name", TRACE_PID + 1 + tp->id, 0, name);
+        if (tp->expand_ts) {
+            snprintf(name, sizeof(name), "expand %s:%s", tp->host, tp->port);
+            snprintf(args, sizeof(args), "{\"endpoints\":%d}",
+                     tp->num_endpoints);
+            trace_span(TRACE_PID, TRACE_TID_MAIN, name,
+                       tp->expand_ts, tp->expand_dur, args);
+        }
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (getnameinfo((struct sockaddr *) &ep->addr, ep->addrlen,
+                            name, sizeof(name), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+                trace_meta("thread_name", TRACE_PID + 1 + tp->id,
+                           ep->id, name);
+            }
+        }
+    }
+}
+
+static void
+trace_end(void)
+{
+    if (! trace) {
+        return;
+    }
+    fputs("\n]}\n", trace);
+    if (fclose(trace) == EOF) {
+        fprintf(stderr, "%s: trace: %s\n", progname, strerror(errno));
+    }
+    trace = NULL;
+}
+
+/*
+ * Register an output sink. This is handed to the happy_sink_init()
+ * function of sink modules.
+ */
+
+static int
+sink_register(const struct happy_sink *sink)
+{
+    if (! sink || sink->abi != HAPPY_SINK_ABI) {
+        fprintf(stderr, "%s: sink %s: incompatible interface version\n",
+                progname, (sink && sink->name) ? sink->name : "?");
+        return -1;
+    }
+    if (num_sinks == SINK_MAX) {
+        fprintf(stderr, "%s: sink %s: too many sinks\n",
+                progname, sink->name ? sink->name : "?");
+        return -1;
+    }
+    sinks[num_sinks++] = sink;
+    return 0;
+}
+
+/*
+ * Load a sink module. The spec is the path of a shared object,
+ * optionally followed by a ':' and an argument passed to the module.
+ */
+
+static void
+sink_load(const char *spec)
+{
+    char *path, *arg;
+    void *handle;
+    happy_sink_init_t init;
+
+    path = xstrdup(spec);
+    arg = strchr(path, ':');
+    if (arg) {
+        *arg++ = 0;
+    }
+
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (! handle) {
+        fprintf(stderr, "%s: dlopen: %s\n", progname, dlerror());
+        exit(EXIT_FAILURE);
+    }
+    *(void **) (&init) = dlsym(handle, "happy_sink_init");
+    if (! init) {
+        fprintf(stderr, "%s: dlsym: %s\n", progname, dlerror());
+        exit(EXIT_FAILURE);
+    }
+    if (init(arg, sink_register) != 0) {
+        fprintf(stderr, "%s: %s: sink initialization failed\n",
+                progname, path);
+        exit(EXIT_FAILURE);
+    }
+
+    free(path);
+}
+
+static void
+sink_begin(void)
+{
+    int i;
+
+    for (i = 0; i < num_sinks; i++) {
+        if (sinks[i]->begin) {
+            sinks[i]->begin(sinks[i]->ctx);
+        }
+    }
+}
+
+/*
+ * Pass a finished connection attempt, described by an EV_DONE or
+ * EV_TIMEOUT event, to all sinks interested in individual samples.
+ */
+
+static void
+sink_sample(target_t *tp, endpoint_t *ep, const evlog_event_t *ev)
+{
+    struct happy_sample sample;
+    int i;
+
+    sample.endpoint = ep->id;
+    sample.host = tp->host;
+    sample.port = tp->port;
+    sample.addr = (struct sockaddr *) &ep->addr;
+    sample.addrlen = ep->addrlen;
+    sample.family = ep->family;
+    sample.status = (ev->type == EV_TIMEOUT)
+        ? HAPPY_SAMPLE_TIMEOUT : HAPPY_SAMPLE_DONE;
+    sample.err = ev->err;
+    sample.timestamp = ev->ts;
+    sample.elapsed = ev->value;
+
+    for (i = 0; i < num_sinks; i++) {
+        if (sinks[i]->sample) {
+            sinks[i]->sample(sinks[i]->ctx, &sample);
+        }
+    }
+}
+
+static void
+sink_record(const struct happy_record *record)
+{
+    int i;
+
+    for (i = 0; i < num_sinks; i++) {
+        if (sinks[i]->record) {
+            sinks[i]->record(sinks[i]->ctx, record);
+        }
+    }
+}
+
+static void
+sink_end(void)
+{
+    int i;
+
+    for (i = 0; i < num_sinks; i++) {
+        if (sinks[i]->end) {
+            sinks[i]->end(sinks[i]->ctx);
+        }
+    }
+}
+
+/*
+ * Events observed while probing are handed to a writer thread, which
+ * appends them to the raw event log, passes samples to the sinks and
+ * writes trace events. This keeps file I/O and sink processing out of
+ * the measurement loop.
+ * All probing happens on the main thread, hence a single-producer
+ * single-consumer ring with atomic head and tail indexes suffices and
+ * the producer never takes a lock or makes a system call. The writer
+ * polls the ring and naps briefly when it is empty. If the ring is
+ * full, the producer yields until the writer catches up; this is
+ * counted and reported since it means the timings may be affected.
+ */
+
+#define RING_SIZE		65536	/* power of two */
+#define RING_NAP		1000000	/* writer nap in ns */
+
+typedef struct handoff {
+    evlog_event_t ev;
+    target_t *tp;
+    endpoint_t *ep;
+    const char *name;		/* EV_SPAN only */
+    const char *args;		/* EV_SPAN only, format for value, err */
+    int64_t dur;		/* EV_SPAN only */
+} handoff_t;
+
+static struct {
+    handoff_t *slots;
+    size_t head;		/* next slot written by the producer */
+    size_t tail;		/* next slot read by the writer */
+    int running;
+    int stop;
+    unsigned long stalls;	/* cumulative, exported as a metric */
+    unsigned long warned;	/* stalls already warned about */
+    pthread_t thread;
+} ring;
+
+/*
+ * Turn an event into a trace event. Connection attempts become spans
+ * on the track of the endpoint, ending when the attempt finished.
+ */
+
+static void
+trace_deliver(const handoff_t *h)
+{
+    char args[96];
+    int pid = TRACE_PID, tid = TRACE_TID_MAIN;
+
+    if (h->ep) {
+        pid = TRACE_PID + 1 + h->tp->id;
+        tid = h->ep->id;
+    }
+
+    switch (h->ev.type) {
+    case EV_DONE:
+        snprintf(args, sizeof(args), "{\"result\":\"%s\",\"err\":%d}",
+                 h->ev.err ? "failed" : "ok", h->ev.err);
+        trace_span(pid, tid, "connect", h->ev.ts - h->ev.value,
+                   h->ev.value, args);
+        break;
+    case EV_TIMEOUT:
+        trace_span(pid, tid, "connect", h->ev.ts - h->ev.value,
+                   h->ev.value, "{\"result\":\"timeout\"}");
+        break;
+    case EV_FAIL:
+        snprintf(args, sizeof(args), "{\"errno\":%d}", h->ev.err);
+        trace_span(pid, tid, "connect failed", h->ev.ts, -1, args);
+        break;
+    case EV_SPAN:
+        if (h->args) {
+            snprintf(args, sizeof(args), h->args, h->ev.value, h->ev.err);
+        }
+        trace_span(pid, tid, h->name, h->ev.ts, h->dur,
+                   h->args ? args : NULL);
+        break;
+    }
+}
+
+/*
+ * Deliver an event to the raw event log, the sinks and the trace. This
+ * runs on the writer thread while probing and inline otherwise.
+ */
+
+static void
+deliver(const handoff_t *h)
+{
+    if (evlog && h->ev.type != EV_SPAN) {
+        evlog_write(&h->ev, sizeof(h->ev));
+    }
+    if (num_sinks && h->ep
+        && (h->ev.type == EV_DONE || h->ev.type == EV_TIMEOUT)) {
+        sink_sample(h->tp, h->ep, &h->ev);
+    }
+    if (trace) {
+        trace_deliver(h);
+    }
+}
+
+static void*
+writer(void *arg)
+{
+    size_t head, tail;
+    struct timespec nap = { 0, RING_NAP };
+    int64_t start;
+
+    while (1) {
+        head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+        tail = ring.tail;
+        if (head == tail) {
+            if (__atomic_load_n(&ring.stop, __ATOMIC_ACQUIRE)
+                && head == __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            (void) nanosleep(&nap, NULL);
+            continue;
+        }
+        start = trace ? now_us() : 0;
+        for (; tail != head; tail++) {
+            deliver(&ring.slots[tail & (RING_SIZE - 1)]);
+        }
+        __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+        if (trace) {
+            trace_span(TRACE_PID, TRACE_TID_WRITER, "drain",
+                       start, now_us() - start, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the writer thread if there is anyone to deliver events to. It
+ * runs until writer_stop(), across all runs of the continuous mode.
+ */
+
+static void
+writer_start(void)
+{
+    int rc;
+    sigset_t set, old;
+
+    if (ring.running || (! evlog && ! num_sinks && ! trace)) {
+        return;
+    }
+
+    ring.slots = xcalloc(RING_SIZE, sizeof(handoff_t));
+    ring.head = ring.tail = 0;
+    ring.stop = 0;
+    /* signals are for the main thread, which probes and reports */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    rc = pthread_create(&ring.thread, NULL, writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc) {
+        fprintf(stderr, "%s: pthread_create: %s\n", progname, strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+    ring.running = 1;
+}
+
+/*
+ * Warn once about the stalls since the last warning.
+ */
+
+static void
+writer_warn(void)
+{
+    if (ring.stalls != ring.warned) {
+        fprintf(stderr, "%s: event writer fell behind %lu times "
+                "(timings may be affected)\n", progname,
+                ring.stalls - ring.warned);
+        ring.warned = ring.stalls;
+    }
+}
+
+/*
+ * Wait until the writer thread has delivered all events posted so far.
+ * This is needed before endpoints are moved or freed, since pending
+ * events refer to them.
+ */
+
+static void
+writer_drain(void)
+{
+    struct timespec nap = { 0, RING_NAP };
+
+    if (! ring.running) {
+        return;
+    }
+
+    while (__atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) != ring.head) {
+        (void) nanosleep(&nap, NULL);
+    }
+    writer_warn();
+}
+
+/*
+ * Let the writer thread drain the ring and wait for it to finish.
+ */
+
+static void
+writer_stop(void)
+{
+    if (! ring.running) {
+        return;
+    }
+
+    __atomic_store_n(&ring.stop, 1, __ATOMIC_RELEASE);
+    (void) pthread_join(ring.thread, NULL);
+    ring.running = 0;
+    free(ring.slots);
+    ring.slots = NULL;
+    writer_warn();
+}
+
+/*
+ * Hand an event over to the writer thread, or deliver it right away
+ * if the writer is not running.
+ */
+
+static void
+post(const handoff_t *h)
+{
+    size_t head;
+
+    if (! ring.running) {
+        deliver(h);
+        return;
+    }
+
+    head = ring.head;
+    if (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+        ring.stalls++;
+        while (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE)
+               == RING_SIZE) {
+            sched_yield();
+        }
+    }
+    ring.slots[head & (RING_SIZE - 1)] = *h;
+    __atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Post an event of an endpoint of a target. A NULL timestamp means
+ * now. The value of errno is preserved so that callers can still
+ * report an error after posting it.
+ */
+
+static void
+post_event(int type, target_t *tp, endpoint_t *ep,
+           const struct timeval *tv, int value, int err)
+{
+    handoff_t h;
+    struct timeval now;
+    int saved_errno = errno;
+
+    if (! evlog && ! num_sinks && ! trace) {
+        return;
+    }
+
+    if (! tv) {
+        (void) gettimeofday(&now, NULL);
+        tv = &now;
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.ev.type = type;
+    h.ev.family = ep ? ep->family : 0;
+    h.ev.id = ep ? ep->id : 0;
+    h.ev.ts = tv2us(tv);
+    h.ev.value = value;
+    h.ev.err = err;
+    h.tp = tp;
+    h.ep = ep;
+    post(&h);
+    errno = saved_errno;
+}
+
+/*
+ * Post a trace span that started at start (us) and lasts until now.
+ * Spans of an endpoint go to its track, all others to the track of
+ * the main thread. The name and the optional args, a format for a
+ * JSON object using value and err, must be static strings.
+ */
+
+static void
+post_span(const char *name, const char *args, target_t *tp,
+          endpoint_t *ep, int64_t start, int value, int err)
+{
+    handoff_t h;
+
+    if (! trace) {
+        return;
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.ev.type = EV_SPAN;
+    h.ev.ts = start;
+    h.ev.value = value;
+    h.ev.err = err;
+    h.tp = tp;
+    h.ep = ep;
+    h.name = name;
+    h.args = args;
+    h.dur = now_us() - start;
+    post(&h);
+}
+
+/*
+ * Create the shared memory segment for live statistics and set up a
+ * slot for every endpoint (see happy-shm.h). The segment is left in
+ * place when we exit so that the final statistics can still be
+ * inspected, e.g. with happy-top.
+ */
+
+static void
+live_begin(const char *name, target_t *targets)
+{
+    char *path;
+    int fd, n;
+    size_t size;
+    unsigned int num = 0;
+    target_t *tp;
+    endpoint_t *ep;
+    struct happy_shm_endpoint *slot;
+    struct timeval now;
+    char serv[NI_MAXSERV];
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            num++;
+        }
+    }
+
+    xasprintf(&path, "%s%s", (*name == '/') ? "" : "/", name);
+    /* replace rather than reuse an existing segment, readers may still
+     * have the old one mapped */
+    (void) shm_unlink(path);
+    fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "%s: shm_open: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    size = sizeof(struct happy_shm) + num * sizeof(*slot);
+    if (ftruncate(fd, size) == -1) {
+        fprintf(stderr, "%s: ftruncate: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    live = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (live == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    (void) close(fd);
+    free(path);
+
+    (void) gettimeofday(&now, NULL);
+    live->version = HAPPY_SHM_VERSION;
+    live->endpoint_size = sizeof(*slot);
+    live->num_endpoints = num;
+    live->pid = getpid();
+    live->started = tv2us(&now);
+    live->nqueries = nqueries;
+
+    slot = live->endpoints;
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++, slot++) {
+            slot->id = ep->id;
+            slot->family = ep->family;
+            snprintf(slot->host, sizeof(slot->host), "%s", tp->host);
+            snprintf(slot->port, sizeof(slot->port), "%s", tp->port);
+            n = getnameinfo((struct sockaddr *) &ep->addr, ep->addrlen,
+                            slot->addr, sizeof(slot->addr),
+                            serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                snprintf(slot->addr, sizeof(slot->addr), "?");
+            }
+            ep->live = slot;
+        }
+    }
+
+    __atomic_store_n(&live->magic, HAPPY_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+/*
+ * Publish a finished connection attempt of an endpoint. This is a
+ * handful of stores into shared memory, bracketed by the sequence
+ * counter of the slot; no system calls are involved.
+ */
+
+static void
+live_sample(endpoint_t *ep, const struct timeval *tv,
+            unsigned int us, int ok, int timedout)
+{
+    struct happy_shm_endpoint *slot = ep->live;
+    uint32_t seq;
+
+    if (! slot) {
+        return;
+    }
+
+    seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->state = ep->state;
+    slot->attempts++;
+    if (ok) {
+        slot->ok++;
+        slot->last = us;
+        slot->sum += us;
+        if (! slot->min || us < slot->min) {
+            slot->min = us;
+        }
+        if (us > slot->max) {
+            slot->max = us;
+        }
+    } else {
+        slot->last = -us;
+        if (timedout) {
+            slot->timeouts++;
+        } else {
+            slot->failed++;
+        }
+    }
+    slot->updated = tv2us(tv);
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void
+live_round(int round)
+{
+    if (live) {
+        __atomic_store_n(&live->round, round, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+live_end(void)
+{
+    if (live) {
+        __atomic_store_n(&live->done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Host-wide coordination (-G). Instances naming the same POSIX shared
+ * memory segment share a budget of connects per second and of
+ * connection attempts in flight. The rate works like a virtual clock:
+ * every connect reserves the next free slot of a shared schedule with
+ * a compare-and-swap on the time the slot is due and waits for it, so
+ * the connects of all instances are spaced 1/rate apart and never
+ * burst. The schedule runs on the monotonic clock, which all
+ * instances on the host share. Attempts in flight are counted in the
+ * segment and per instance, so that the share of an instance that
+ * died without cleaning up is returned by the next instance that
+ * joins. The limits are set by the instance creating the segment and
+ * replaced by every instance giving them again.
+ */
+
+#define COORD_MAGIC		0x48415043	/* "HAPC" */
+#define COORD_VERSION		2
+#define COORD_INSTANCES		64
+#define COORD_POLL		5000	/* us, retry for a socket */
+
+typedef struct coord {
+    uint32_t magic;			/* set last, once initialized */
+    uint32_t version;
+    uint32_t rate;			/* connects per second, 0: no limit */
+    uint32_t sockets;			/* attempts in flight, 0: no limit */
+    int64_t next;			/* us (CLOCK_MONOTONIC), next free slot */
+    uint32_t inflight;
+    uint32_t pad;
+    struct {
+        int64_t pid;			/* 0 if free */
+        uint32_t inflight;
+        uint32_t pad;
+    } instances[COORD_INSTANCES];
+} coord_t;
+
+static coord_t *coord = NULL;
+static int coord_me = -1;		/* our instance slot */
+static int coord_held = 0;		/* we hold a socket not yet used */
+static int64_t coord_slot = 0;		/* reserved connect slot (us) */
+
+static void
+coord_open(const char *spec)
+{
+    char *name, *p, *endptr, *path;
+    long num[2] = { -1, -1 };
+    int fd, i, created = 1;
+    struct stat st;
+    int64_t owner, expect;
+    uint32_t n;
+
+    name = xstrdup(spec);
+    p = strchr(name, ':');
+    for (i = 0; p; i++) {
+        *p++ = 0;
+        if (i == 2 || ! *name) {
+            fprintf(stderr, "%s: invalid argument '%s' for option -G\n",
+                    progname, spec);
+            exit(EXIT_FAILURE);
+        }
+        num[i] = strtol(p, &endptr, 10);
+        if (endptr == p || num[i] < 0 || num[i] > INT_MAX
+            || (*endptr && *endptr != ':')) {
+            fprintf(stderr, "%s: invalid argument '%s' for option -G\n",
+                    progname, spec);
+            exit(EXIT_FAILURE);
+        }
+        p = *endptr ? endptr : NULL;
+    }
+
+    xasprintf(&path, "%s%s", (*name == '/') ? "" : "/", name);
+    fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd == -1 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(path, O_RDWR, 0);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "%s: shm_open: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (created && ftruncate(fd, sizeof(coord_t)) == -1) {
+        fprintf(stderr, "%s: ftruncate: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    /* the creator may not have sized the segment yet */
+    for (i = 0; ! created; i++) {
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(coord_t)) {
+            break;
+        }
+        if (i == 100) {
+            fprintf(stderr, "%s: %s: not a coordination segment\n",
+                    progname, name);
+            exit(EXIT_FAILURE);
+        }
+        usleep(10000);
+    }
+    coord = mmap(NULL, sizeof(coord_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    if (coord == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    (void) close(fd);
+
+    if (created) {
+        coord->version = COORD_VERSION;
+        coord->rate = num[0] > 0 ? num[0] : 0;
+        coord->sockets = num[1] > 0 ? num[1] : 0;
+        __atomic_store_n(&coord->magic, COORD_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        for (i = 0; __atomic_load_n(&coord->magic, __ATOMIC_ACQUIRE)
+                 != COORD_MAGIC; i++) {
+            if (i == 100) {
+                fprintf(stderr, "%s: %s: not a coordination segment\n",
+                        progname, name);
+                exit(EXIT_FAILURE);
+            }
+            usleep(10000);
+        }
+        if (coord->version != COORD_VERSION) {
+            fprintf(stderr, "%s: %s: incompatible segment version\n",
+                    progname, name);
+            exit(EXIT_FAILURE);
+        }
+        if (num[0] >= 0) {
+            __atomic_store_n(&coord->rate, num[0], __ATOMIC_RELAXED);
+        }
+        if (num[1] >= 0) {
+            __atomic_store_n(&coord->sockets, num[1], __ATOMIC_RELAXED);
+        }
+    }
+
+    /* return the sockets of dead instances and take a free slot */
+    for (i = 0; i < COORD_INSTANCES; i++) {
+        owner = __atomic_load_n(&coord->instances[i].pid, __ATOMIC_ACQUIRE);
+        expect = owner;
+        if (owner > 0 && kill((pid_t) owner, 0) == -1 && errno == ESRCH
+            && __atomic_compare_exchange_n(&coord->instances[i].pid,
+                                           &expect, -1, 0, __ATOMIC_ACQ_REL,
+                                           __ATOMIC_ACQUIRE)) {
+            n = __atomic_exchange_n(&coord->instances[i].inflight, 0,
+                                    __ATOMIC_ACQ_REL);
+            __atomic_sub_fetch(&coord->inflight, n, __ATOMIC_ACQ_REL);
+            __atomic_store_n(&coord->instances[i].pid, 0, __ATOMIC_RELEASE);
+            owner = 0;
+        }
+        expect = 0;
+        if (coord_me == -1 && owner == 0
+            && __atomic_compare_exchange_n(&coord->instances[i].pid,
+                                           &expect, (int64_t) getpid(), 0,
+                                           __ATOMIC_ACQ_REL,
+                                           __ATOMIC_ACQUIRE)) {
+            coord_me = i;
+        }
+    }
+    if (coord_me == -1) {
+        fprintf(stderr, "%s: %s: too many instances\n", progname, name);
+        exit(EXIT_FAILURE);
+    }
+    free(path);
+    free(name);
+}
+
+/*
+ * Ask for permission to start a connect. Returns 1 if the connect may
+ * start now and then owns a socket of the budget, which has to be
+ * returned with coord_release(). Otherwise, wait is set to the number
+ * of microseconds to wait before asking again.
+ */
+
+static int
+coord_acquire(int64_t *wait)
+{
+    uint32_t n, limit, rate;
+    int64_t now, next, slot;
+
+    if (! coord) {
+        return 1;
+    }
+    /* the schedule is shared, it must not follow steps of the wall
+     * clock of the host */
+    now = prof_clock(CLOCK_MONOTONIC);
+    if (! coord_held) {
+        limit = __atomic_load_n(&coord->sockets, __ATOMIC_RELAXED);
+        n = __atomic_load_n(&coord->inflight, __ATOMIC_RELAXED);
+        do {
+            if (limit && n >= limit) {
+                *wait = COORD_POLL;
+                return 0;
+            }
+        } while (! __atomic_compare_exchange_n(&coord->inflight, &n, n + 1,
+                                               1, __ATOMIC_ACQ_REL,
+                                               __ATOMIC_RELAXED));
+        __atomic_add_fetch(&coord->instances[coord_me].inflight, 1,
+                           __ATOMIC_RELAXED);
+        coord_held = 1;
+    }
+    rate = __atomic_load_n(&coord->rate, __ATOMIC_RELAXED);
+    if (! coord_slot && rate) {
+        next = __atomic_load_n(&coord->next, __ATOMIC_RELAXED);
+        do {
+            slot = next > now ? next : now;
+        } while (! __atomic_compare_exchange_n(&coord->next, &next,
+                                               slot + 1000000 / rate, 1,
+                                               __ATOMIC_ACQ_REL,
+                                               __ATOMIC_RELAXED));
+        coord_slot = slot;
+    }
+    if (coord_slot > now) {
+        *wait = coord_slot - now;
+        return 0;
+    }
+    coord_slot = 0;
+    coord_held = 0;
+    return 1;
+}
+
+/*
+ * Return a socket of the budget once a connection attempt is over.
+ */
+
+static void
+coord_release(void)
+{
+    if (coord) {
+        __atomic_sub_fetch(&coord->instances[coord_me].inflight, 1,
+                           __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&coord->inflight, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+static void
+coord_end(void)
+{
+    if (! coord) {
+        return;
+    }
+    if (coord_held) {
+        coord_release();
+        coord_held = 0;
+    }
+    __atomic_store_n(&coord->instances[coord_me].pid, 0, __ATOMIC_RELEASE);
+    (void) munmap(coord, sizeof(coord_t));
+    coord = NULL;
+}
+
+/*
+ * Metrics endpoint (-M). A minimal HTTP server exposes the statistics
+ * in the OpenMetrics text format. It is driven by the select() loops
+ * in prepare() and collect(): the listening socket and the client
+ * connections are added to the fd sets, and metrics_serve() runs after
+ * update() has processed the probes. Responses are rendered
+ * incrementally, at most METRICS_CHUNK targets per pass, and written
+ * without blocking, so that a scrape never holds up the detection of
+ * finished connection attempts for long, however many targets exist.
+ */
+
+#define METRICS_CLIENTS		8
+#define METRICS_CHUNK		256
+
+#define MC_READ			0
+#define MC_RENDER		1
+#define MC_DRAIN		2
+
+static const unsigned int metrics_bounds[METRICS_BUCKETS] = {
+    1000, 2000, 5000, 10000, 20000, 50000,
+    100000, 200000, 500000, 1000000, 2000000, 5000000
+};
+
+static const char *metrics_families[2] = { "ipv4", "ipv6" };
+
+typedef struct metrics_client {
+    int fd;
+    int state;
+    char in[1024];
+    size_t inlen;
+    char *out;
+    size_t outlen;
+    size_t outoff;
+    size_t outsize;
+    int section;			/* metric family being rendered */
+    target_t *cursor;			/* next target of the section */
+} metrics_client_t;
+
+static int metrics_fd = -1;
+static metrics_client_t metrics_clients[METRICS_CLIENTS];
+
+static int
+metrics_family(int family)
+{
+    return (family == AF_INET) ? 0 : (family == AF_INET6) ? 1 : -1;
+}
+
+/*
+ * Open the listening socket. The spec is a port, optionally preceded
+ * by an address and a colon (IPv6 addresses in brackets).
+ */
+
+static void
+metrics_listen(const char *spec)
+{
+    struct addrinfo hints, *ai;
+    char *addr, *port;
+    int n, fd, on = 1;
+
+    addr = xstrdup(spec);
+    port = strrchr(addr, ':');
+    if (port) {
+        *port++ = 0;
+        if (addr[0] == '[' && addr[strlen(addr) - 1] == ']') {
+            addr[strlen(addr) - 1] = 0;
+            memmove(addr, addr + 1, strlen(addr));
+        }
+    } else {
+        port = addr;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    n = getaddrinfo((port == addr || ! *addr) ? NULL : addr, port,
+                    &hints, &ai);
+    if (n != 0) {
+        fprintf(stderr, "%s: getaddrinfo: %s (metrics %s)\n",
+                progname, gai_strerror(n), spec);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1
+        || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+        || bind(fd, ai->ai_addr, ai->ai_addrlen) == -1
+        || listen(fd, METRICS_CLIENTS) == -1
+        || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        fprintf(stderr, "%s: metrics %s: %s\n",
+                progname, spec, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    freeaddrinfo(ai);
+    free(addr);
+
+    for (n = 0; n < METRICS_CLIENTS; n++) {
+        metrics_clients[n].fd = -1;
+    }
+    metrics_fd = fd;
+
+    /* clients going away must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/*
+ * Allocate the statistics of all targets.
+ */
+
+static void
+metrics_begin(target_t *targets)
+{
+    target_t *tp;
+
+    if (metrics_fd == -1) {
+        return;
+    }
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (! tp->stats) {
+            tp->stats = xcalloc(1, sizeof(tstats_t));
+        }
+    }
+}
+
+/*
+ * Account a finished connection attempt in the target statistics.
+ */
+
+static void
+metrics_sample(target_t *tp, endpoint_t *ep, unsigned int us,
+               int ok, int timedout)
+{
+    int f, b;
+
+    if (! tp->stats || (f = metrics_family(ep->family)) < 0) {
+        return;
+    }
+
+    if (ok) {
+        for (b = 0; b < METRICS_BUCKETS && us > metrics_bounds[b]; b++) ;
+        tp->stats->family[f].buckets[b]++;
+        tp->stats->family[f].sum += us;
+        tp->stats->family[f].ok++;
+    } else if (timedout) {
+        tp->stats->family[f].timeouts++;
+    } else {
+        tp->stats->family[f].failed++;
+    }
+}
+
+static void
+mc_printf(metrics_client_t *mc, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(mc->out + mc->outlen, mc->outsize - mc->outlen,
+                      fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t) n < mc->outsize - mc->outlen) {
+            mc->outlen += n;
+            return;
+        }
+        mc->outsize = mc->outsize ? 2 * mc->outsize : 8192;
+        mc->out = xrealloc(mc->out, mc->outsize);
+    }
+}
+
+/*
+ * Write the target label, escaping as required by OpenMetrics.
+ */
+
+static void
+mc_target(metrics_client_t *mc, target_t *tp, int f)
+{
+    const char *p;
+
+    mc_printf(mc, "{target=\"");
+    for (p = tp->host; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            mc_printf(mc, "\\%c", *p);
+        } else if (*p == '\n') {
+            mc_printf(mc, "\\n");
+        } else {
+            mc_printf(mc, "%c", *p);
+        }
+    }
+    mc_printf(mc, ":%s\",family=\"%s\"", tp->port, metrics_families[f]);
+}
+
+/*
+ * Render the next piece of a response.
+ */
+
+static void
+metrics_render(metrics_client_t *mc)
+{
+    int n, f, b;
+    uint64_t cum;
+    target_t *tp;
+    tstats_t *st;
+
+    switch (mc->section) {
+    case 0:
+        mc_printf(mc, "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: application/openmetrics-text; "
+                  "version=1.0.0; charset=utf-8\r\n"
+                  "Connection: close\r\n\r\n");
+        mc_printf(mc, "# TYPE happy_connect_seconds histogram\n"
+                  "# UNIT happy_connect_seconds seconds\n"
+                  "# HELP happy_connect_seconds Time to establish "
+                  "TCP connections.\n");
+        mc->cursor = targets;
+        mc->section++;
+        break;
+
+    case 1:
+        for (tp = mc->cursor, n = 0;
+             target_valid(tp) && n < METRICS_CHUNK; tp = tp->next, n++) {
+            if (! (st = tp->stats)) {
+                continue;
+            }
+            for (f = 0; f < 2; f++) {
+                if (! (st->family[f].ok + st->family[f].failed
+                       + st->family[f].timeouts)) {
+                    continue;
+                }
+                for (b = 0, cum = 0; b <= METRICS_BUCKETS; b++) {
+                    cum += st->family[f].buckets[b];
+                    mc_printf(mc, "happy_connect_seconds_bucket");
+                    mc_target(mc, tp, f);
+                    if (b < METRICS_BUCKETS) {
+                        mc_printf(mc, ",le=\"%g\"} %llu\n",
+                                  metrics_bounds[b] / 1e6,
+                                  (unsigned long long) cum);
+                    } else {
+                        mc_printf(mc, ",le=\"+Inf\"} %llu\n",
+                                  (unsigned long long) cum);
+                    }
+                }
+                mc_printf(mc, "happy_connect_seconds_count");
+                mc_target(mc, tp, f);
+                mc_printf(mc, "} %llu\n", (unsigned long long) cum);
+                mc_printf(mc, "happy_connect_seconds_sum");
+                mc_target(mc, tp, f);
+                mc_printf(mc, "} %.6f\n", st->family[f].sum / 1e6);
+            }
+        }
+        mc->cursor = tp;
+        if (! target_valid(tp)) {
+            mc_printf(mc, "# TYPE happy_connect_attempts counter\n"
+                      "# HELP happy_connect_attempts Finished connection "
+                      "attempts by result.\n");
+            mc->cursor = targets;
+            mc->section++;
+        }
+        break;
+
+    case 2:
+        for (tp = mc->cursor, n = 0;
+             target_valid(tp) && n < METRICS_CHUNK; tp = tp->next, n++) {
+            if (! (st = tp->stats)) {
+                continue;
+            }
+            for (f = 0; f < 2; f++) {
+                if (! (st->family[f].ok + st->family[f].failed
+                       + st->family[f].timeouts)) {
+                    continue;
+                }
+                mc_printf(mc, "happy_connect_attempts_total");
+                mc_target(mc, tp, f);
+                mc_printf(mc, ",result=\"ok\"} %llu\n",
+                          (unsigned long long) st->family[f].ok);
+                mc_printf(mc, "happy_connect_attempts_total");
+                mc_target(mc, tp, f);
+                mc_printf(mc, ",result=\"failed\"} %llu\n",
+                          (unsigned long long) st->family[f].failed);
+                mc_printf(mc, "happy_connect_attempts_total");
+                mc_target(mc, tp, f);
+                mc_printf(mc, ",result=\"timeout\"} %llu\n",
+                          (unsigned long long) st->family[f].timeouts);
+            }
+        }
+        mc->cursor = tp;
+        if (! target_valid(tp)) {
+            mc->section++;
+        }
+        break;
+
+    case 3:
+        mc_printf(mc, "# TYPE happy_rounds counter\n"
+                  "happy_rounds_total %lu\n", engine.rounds);
+        mc_printf(mc, "# TYPE happy_connects_started counter\n"
+                  "happy_connects_started_total %lu\n", engine.connects);
+        mc_printf(mc, "# TYPE happy_select_calls counter\n"
+                  "happy_select_calls_total %lu\n", engine.selects);
+        mc_printf(mc, "# TYPE happy_sockets_connecting gauge\n"
+                  "happy_sockets_connecting %d\n", engine.connecting);
+        mc_printf(mc, "# TYPE happy_writer_stalls counter\n"
+                  "happy_writer_stalls_total %lu\n", ring.stalls);
+        mc_printf(mc, "# TYPE happy_scrapes counter\n"
+                  "happy_scrapes_total %lu\n", engine.scrapes);
+        mc_printf(mc, "# TYPE happy_cache_hits counter\n"
+                  "happy_cache_hits_total %lu\n", engine.cached);
+        mc_printf(mc, "# EOF\n");
+        mc->section++;
+        mc->state = MC_DRAIN;
+        break;
+    }
+}
+
+static void
+metrics_close(metrics_client_t *mc)
+{
+    (void) SYS(close(mc->fd));
+    free(mc->out);
+    memset(mc, 0, sizeof(*mc));
+    mc->fd = -1;
+}
+
+/*
+ * Add the listening socket and the client connections to the fd sets
+ * and return the new highest file descriptor.
+ */
+
+static int
+metrics_fdset(fd_set *rfds, fd_set *wfds, int max)
+{
+    int i;
+    metrics_client_t *mc;
+
+    FD_ZERO(rfds);
+    if (metrics_fd == -1) {
+        return max;
+    }
+
+    FD_SET(metrics_fd, rfds);
+    if (metrics_fd > max) {
+        max = metrics_fd;
+    }
+    for (i = 0; i < METRICS_CLIENTS; i++) {
+        mc = &metrics_clients[i];
+        if (mc->fd == -1) {
+            continue;
+        }
+        if (mc->state == MC_READ) {
+            FD_SET(mc->fd, rfds);
+        } else {
+            FD_SET(mc->fd, wfds);
+        }
+        if (mc->fd > max) {
+            max = mc->fd;
+        }
+    }
+    return max;
+}
+
+/*
+ * Accept new clients, read requests and render and write responses.
+ */
+
+static void
+metrics_serve(fd_set *rfds, fd_set *wfds)
+{
+    int i, fd;
+    ssize_t n;
+    metrics_client_t *mc;
+
+    if (metrics_fd == -1) {
+        return;
+    }
+
+    if (FD_ISSET(metrics_fd, rfds)) {
+        while ((fd = SYS(accept(metrics_fd, NULL, NULL))) != -1) {
+            for (i = 0; i < METRICS_CLIENTS
+                     && metrics_clients[i].fd != -1; i++) ;
+            if (i == METRICS_CLIENTS
+                || SYS(fcntl(fd, F_SETFL,
+                             SYS(fcntl(fd, F_GETFL, 0)) | O_NONBLOCK))) {
+                (void) SYS(close(fd));
+                continue;
+            }
+            metrics_clients[i].fd = fd;
+            metrics_clients[i].state = MC_READ;
+        }
+    }
+
+    for (i = 0; i < METRICS_CLIENTS; i++) {
+        mc = &metrics_clients[i];
+        if (mc->fd == -1) {
+            continue;
+        }
+
+        if (mc->state == MC_READ && FD_ISSET(mc->fd, rfds)) {
+            n = SYS(recv(mc->fd, mc->in + mc->inlen,
+                         sizeof(mc->in) - 1 - mc->inlen, 0));
+            if (n <= 0) {
+                metrics_close(mc);
+                continue;
+            }
+            mc->inlen += n;
+            mc->in[mc->inlen] = 0;
+            if (! strstr(mc->in, "\r\n\r\n") && ! strstr(mc->in, "\n\n")) {
+                if (mc->inlen == sizeof(mc->in) - 1) {
+                    metrics_close(mc);
+                }
+                continue;
+            }
+            if (strncmp(mc->in, "GET /metrics ", 13) == 0
+                || strncmp(mc->in, "GET / ", 6) == 0) {
+                engine.scrapes++;
+                mc->state = MC_RENDER;
+            } else {
+                mc_printf(mc, "HTTP/1.0 404 Not Found\r\n"
+                          "Connection: close\r\n\r\n");
+                mc->state = MC_DRAIN;
+            }
+        }
+
+        if (mc->state == MC_RENDER) {
+            metrics_render(mc);
+        }
+
+        if (mc->state != MC_READ && mc->outoff < mc->outlen) {
+            n = SYS(send(mc->fd, mc->out + mc->outoff,
+                         mc->outlen - mc->outoff, 0));
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                metrics_close(mc);
+                continue;
+            }
+            if (n > 0) {
+                mc->outoff += n;
+            }
+            if (mc->outoff == mc->outlen) {
+                mc->outoff = mc->outlen = 0;
+            }
+        }
+
+        if (mc->state == MC_DRAIN && mc->outlen == 0) {
+            metrics_close(mc);
+        }
+    }
+}
+
+/*
+ * Rollups (-U) keep a week of history per endpoint in bounded memory.
+ * The raw tier is a ring of the latest ROLLUP_RAW samples; the minute
+ * and hour tiers are rings of bins indexed by time, so that a bin is
+ * reused (and cleared) once its slot comes around again. Every bin
+ * holds a histogram with two buckets per power of two microseconds,
+ * which makes bins mergeable by adding them up: a query over a window
+ * merges the bins of the finest tier that still covers the window.
+ */
+
+#define ROLLUP_RAW		64
+#define ROLLUP_MINUTES		120		/* 2 hours of minute bins */
+#define ROLLUP_HOURS		168		/* 7 days of hour bins */
+#define ROLLUP_BUCKETS		48
+
+typedef struct rbin {
+    int64_t start;			/* seconds since the epoch */
+    uint32_t ok;
+    uint32_t failed;			/* failed or timed out */
+    uint64_t sum;			/* us, successful attempts only */
+    uint32_t min;
+    uint32_t max;
+    uint32_t buckets[ROLLUP_BUCKETS];
+} rbin_t;
+
+typedef struct rollup {
+    struct {
+        int64_t ts;			/* seconds since the epoch */
+        int32_t value;			/* us, -us - 1 for failures */
+    } raw[ROLLUP_RAW];
+    unsigned int nraw;			/* samples ever added */
+    rbin_t minutes[ROLLUP_MINUTES];
+    rbin_t hours[ROLLUP_HOURS];
+} rollup_t;
+
+static int umode = 0;
+
+static int
+rollup_bucket(uint32_t us)
+{
+    uint32_t v = us + 1;
+    int o = 0;
+
+    while (v >> (o + 1)) {
+        o++;
+    }
+    if (o == 0) {
+        return 0;
+    }
+    o = 2 * o + ((v >> (o - 1)) & 1);
+    return o < ROLLUP_BUCKETS ? o : ROLLUP_BUCKETS - 1;
+}
+
+/*
+ * Upper bound (us) of the values counted in a histogram bucket.
+ */
+
+static uint32_t
+rollup_bound(int b)
+{
+    int o = b / 2;
+
+    if (o == 0) {
+        return 0;
+    }
+    return (1U << o) + (b % 2 + 1) * (1U << (o - 1)) - 2;
+}
+
+static void
+rbin_add(rbin_t *bin, uint32_t us, int ok)
+{
+    if (! ok) {
+        bin->failed++;
+        return;
+    }
+    if (! bin->ok || us < bin->min) {
+        bin->min = us;
+    }
+    if (us > bin->max) {
+        bin->max = us;
+    }
+    bin->ok++;
+    bin->sum += us;
+    bin->buckets[rollup_bucket(us)]++;
+}
+
+static void
+rbin_merge(rbin_t *dst, const rbin_t *src)
+{
+    int b;
+
+    if (src->ok) {
+        if (! dst->ok || src->min < dst->min) {
+            dst->min = src->min;
+        }
+        if (src->max > dst->max) {
+            dst->max = src->max;
+        }
+    }
+    dst->ok += src->ok;
+    dst->failed += src->failed;
+    dst->sum += src->sum;
+    for (b = 0; b < ROLLUP_BUCKETS; b++) {
+        dst->buckets[b] += src->buckets[b];
+    }
+}
+
+/*
+ * Value (us) below which the given fraction of the successful attempts
+ * in a bin fall, accurate to the bucket width.
+ */
+
+static uint32_t
+rbin_quantile(const rbin_t *bin, double q)
+{
+    uint64_t rank, n = 0;
+    uint32_t v;
+    int b;
+
+    rank = (uint64_t) (q * bin->ok + 0.5);
+    for (b = 0; b < ROLLUP_BUCKETS; b++) {
+        n += bin->buckets[b];
+        if (n >= rank && n) {
+            break;
+        }
+    }
+    v = rollup_bound(b < ROLLUP_BUCKETS ? b : ROLLUP_BUCKETS - 1);
+    return v < bin->min ? bin->min : v > bin->max ? bin->max : v;
+}
+
+static rbin_t *
+rollup_slot(rbin_t *tier, int size, int width, int64_t sec)
+{
+    rbin_t *bin = &tier[(sec / width) % size];
+
+    if (bin->start != sec - sec % width) {
+        memset(bin, 0, sizeof(*bin));
+        bin->start = sec - sec % width;
+    }
+    return bin;
+}
+
+static void
+rollup_sample(endpoint_t *ep, const struct timeval *tv,
+              unsigned int us, int ok)
+{
+    rollup_t *r = ep->rollup;
+
+    if (! r) {
+        r = ep->rollup = xcalloc(1, sizeof(rollup_t));
+    }
+    r->raw[r->nraw % ROLLUP_RAW].ts = tv->tv_sec;
+    r->raw[r->nraw % ROLLUP_RAW].value = ok ? (int32_t) us
+                                            : -(int32_t) us - 1;
+    r->nraw++;
+    rbin_add(rollup_slot(r->minutes, ROLLUP_MINUTES, 60, tv->tv_sec), us, ok);
+    rbin_add(rollup_slot(r->hours, ROLLUP_HOURS, 3600, tv->tv_sec), us, ok);
+}
+
+/*
+ * Merge the history of the last window seconds into a bin, using the
+ * raw samples if they reach back far enough, the minute bins for up to
+ * two hours and the hour bins beyond. Returns the name of the tier.
+ */
+
+static const char *
+rollup_query(const rollup_t *r, int64_t now, int64_t window, rbin_t *out)
+{
+    int64_t since = now - window;
+    unsigned int i, n;
+    const rbin_t *tier;
+    int size, width;
+
+    memset(out, 0, sizeof(*out));
+    out->start = since;
+    if (! r) {
+        return "none";
+    }
+
+    n = r->nraw < ROLLUP_RAW ? r->nraw : ROLLUP_RAW;
+    if (r->nraw <= ROLLUP_RAW
+        || r->raw[r->nraw % ROLLUP_RAW].ts < since) {
+        for (i = 0; i < n; i++) {
+            if (r->raw[i].ts < since) {
+                continue;
+            }
+            if (r->raw[i].value >= 0) {
+                rbin_add(out, r->raw[i].value, 1);
+            } else {
+                rbin_add(out, -(r->raw[i].value + 1), 0);
+            }
+        }
+        return "raw";
+    }
+
+    if (window <= ROLLUP_MINUTES * 60) {
+        tier = r->minutes, size = ROLLUP_MINUTES, width = 60;
+    } else {
+        tier = r->hours, size = ROLLUP_HOURS, width = 3600;
+    }
+    for (i = 0; i < size; i++) {
+        if (tier[i].start && tier[i].start + width > since
+            && tier[i].start <= now) {
+            rbin_merge(out, &tier[i]);
+        }
+    }
+    return width == 60 ? "minute" : "hour";
+}
+
+/*
+ * Control socket (-C). Clients connect to a Unix domain socket and
+ * send commands, one per line:
+ *
+ *     add-target host [port [interval]]
+ *     remove-target host [port]
+ *     set-interval ms
+ *     dump-stats
+ *     flush
+ *     history seconds [host [port]]
+ *
+ * Every command is answered with "ok" or "error: reason" on a line of
+ * its own, dump-stats first sends the current results in the format
+ * of -m and history the rollups (-U) of the given window. Like the
+ * metrics endpoint, the socket is served from the select() loops.
+ * Commands that change the targets or need the reports are only
+ * queued there and carried out by ctl_apply() between runs, so probes
+ * in flight are never disturbed.
+ */
+
+#define CTL_CLIENTS		4
+
+#define CTL_ADD			1
+#define CTL_REMOVE		2
+#define CTL_DUMP		3
+#define CTL_FLUSH		4
+#define CTL_HISTORY		5
+
+typedef struct ctl_client {
+    int fd;
+    int eof;				/* peer has finished sending */
+    int pending;			/* queued commands not answered */
+    char in[512];
+    size_t inlen;
+    char *out;
+    size_t outlen;
+    size_t outoff;
+    size_t outsize;
+} ctl_client_t;
+
+typedef struct ctl_op {
+    int op;
+    ctl_client_t *client;		/* NULL if the client went away */
+    char *host;
+    char *port;
+    long arg;				/* CTL_HISTORY: seconds, CTL_ADD: ms */
+    struct ctl_op *next;
+} ctl_op_t;
+
+static int ctl_fd = -1;
+static char *ctl_path = NULL;
+static ctl_client_t ctl_clients[CTL_CLIENTS];
+static ctl_op_t *ctl_ops = NULL;
+static ctl_op_t **ctl_tail = &ctl_ops;
+
+static void
+ctl_listen(const char *path)
+{
+    struct sockaddr_un sun;
+    int i;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s: control socket path too long\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(sun.sun_path, path);
+
+    (void) unlink(path);
+    ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctl_fd == -1
+        || bind(ctl_fd, (struct sockaddr *) &sun, sizeof(sun)) == -1
+        || listen(ctl_fd, CTL_CLIENTS) == -1
+        || fcntl(ctl_fd, F_SETFL, fcntl(ctl_fd, F_GETFL, 0) | O_NONBLOCK)) {
+        fprintf(stderr, "%s: control %s: %s\n",
+                progname, path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ctl_path = xstrdup(path);
+
+    for (i = 0; i < CTL_CLIENTS; i++) {
+        ctl_clients[i].fd = -1;
+    }
+
+    /* clients going away must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static void
+ctl_printf(ctl_client_t *cc, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (! cc) {
+        return;
+    }
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(cc->out + cc->outlen, cc->outsize - cc->outlen,
+                      fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t) n < cc->outsize - cc->outlen) {
+            cc->outlen += n;
+            return;
+        }
+        cc->outsize = cc->outsize ? 2 * cc->outsize : 1024;
+        cc->out = xrealloc(cc->out, cc->outsize);
+    }
+}
+
+static void
+ctl_close(ctl_client_t *cc)
+{
+    ctl_op_t *op;
+
+    for (op = ctl_ops; op; op = op->next) {
+        if (op->client == cc) {
+            op->client = NULL;
+        }
+    }
+    (void) SYS(close(cc->fd));
+    free(cc->out);
+    memset(cc, 0, sizeof(*cc));
+    cc->fd = -1;
+}
+
+static ctl_op_t *
+ctl_queue(ctl_client_t *cc, int op, const char *host, const char *port)
+{
+    ctl_op_t *cp;
+
+    cp = xcalloc(1, sizeof(*cp));
+    cp->op = op;
+    cp->client = cc;
+    cp->host = host ? xstrdup(host) : NULL;
+    cp->port = port ? xstrdup(port) : NULL;
+    *ctl_tail = cp;
+    ctl_tail = &cp->next;
+    cc->pending++;
+    return cp;
+}
+
+/*
+ * Parse a command line and answer it right away or queue it.
+ */
+
+static void
+ctl_command(ctl_client_t *cc, char *line)
+{
+    char *argv[4], *p, *endptr;
+    int argc = 0;
+    long num;
+    ctl_op_t *op;
+
+    for (p = strtok(line, " \t\r"); p && argc < 4; p = strtok(NULL, " \t\r")) {
+        argv[argc++] = p;
+    }
+    if (argc == 0) {
+        return;
+    }
+
+    if (strcmp(argv[0], "add-target") == 0 && argc >= 2) {
+        num = 0;
+        if (argc == 4) {
+            num = strtol(argv[3], &endptr, 10);
+            if (num <= 0 || num > INT_MAX || *endptr) {
+                ctl_printf(cc, "error: invalid interval\n");
+                return;
+            }
+            if (fraction) {
+                ctl_printf(cc, "error: no intervals with option -F\n");
+                return;
+            }
+        }
+        op = ctl_queue(cc, CTL_ADD, argv[1], argc > 2 ? argv[2] : "80");
+        op->arg = num;
+    } else if (strcmp(argv[0], "remove-target") == 0
+               && (argc == 2 || argc == 3)) {
+        ctl_queue(cc, CTL_REMOVE, argv[1], argc == 3 ? argv[2] : "80");
+    } else if (strcmp(argv[0], "set-interval") == 0 && argc == 2) {
+        num = strtol(argv[1], &endptr, 10);
+        if (num > 0 && num <= INT_MAX && *endptr == '\0') {
+            interval = num;
+            ctl_printf(cc, "ok\n");
+        } else {
+            ctl_printf(cc, "error: invalid interval\n");
+        }
+    } else if (strcmp(argv[0], "dump-stats") == 0 && argc == 1) {
+        ctl_queue(cc, CTL_DUMP, NULL, NULL);
+    } else if (strcmp(argv[0], "flush") == 0 && argc == 1) {
+        ctl_queue(cc, CTL_FLUSH, NULL, NULL);
+    } else if (strcmp(argv[0], "history") == 0 && argc >= 2) {
+        num = strtol(argv[1], &endptr, 10);
+        if (! umode) {
+            ctl_printf(cc, "error: no history without option -U\n");
+        } else if (num > 0 && num <= ROLLUP_HOURS * 3600L
+                   && *endptr == '\0') {
+            op = ctl_queue(cc, CTL_HISTORY, argc > 2 ? argv[2] : NULL,
+                           argc > 3 ? argv[3] : "80");
+            op->arg = num;
+        } else {
+            ctl_printf(cc, "error: invalid window\n");
+        }
+    } else {
+        ctl_printf(cc, "error: unknown command\n");
+    }
+}
+
+/*
+ * Carry out the complete lines a client has sent. A client with
+ * queued commands is not read any further, so that the answers come
+ * in the order of the commands.
+ */
+
+static void
+ctl_parse(ctl_client_t *cc)
+{
+    char *nl;
+
+    while (! cc->pending && (nl = strchr(cc->in, '\n'))) {
+        *nl = 0;
+        ctl_command(cc, cc->in);
+        cc->inlen -= nl + 1 - cc->in;
+        memmove(cc->in, nl + 1, cc->inlen + 1);
+    }
+    if (cc->inlen == sizeof(cc->in) - 1 && ! strchr(cc->in, '\n')) {
+        ctl_printf(cc, "error: line too long\n");
+        cc->inlen = 0;
+        cc->in[0] = 0;
+        cc->eof = 1;
+    }
+}
+
+/*
+ * Take the next queued command. Once the queue has run dry, clients
+ * get a chance to queue the commands following the answered ones.
+ */
+
+static ctl_op_t *
+ctl_next(void)
+{
+    ctl_op_t *op;
+    int i;
+
+    if (! ctl_ops) {
+        for (i = 0; i < CTL_CLIENTS; i++) {
+            if (ctl_clients[i].fd != -1) {
+                ctl_parse(&ctl_clients[i]);
+            }
+        }
+    }
+    op = ctl_ops;
+    if (op) {
+        ctl_ops = op->next;
+        if (! ctl_ops) {
+            ctl_tail = &ctl_ops;
+        }
+    }
+    return op;
+}
+
+static int
+ctl_fdset(fd_set *rfds, fd_set *wfds, int max)
+{
+    int i;
+    ctl_client_t *cc;
+
+    if (ctl_fd == -1) {
+        return max;
+    }
+
+    FD_SET(ctl_fd, rfds);
+    if (ctl_fd > max) {
+        max = ctl_fd;
+    }
+    for (i = 0; i < CTL_CLIENTS; i++) {
+        cc = &ctl_clients[i];
+        if (cc->fd == -1) {
+            continue;
+        }
+        if (! cc->eof && ! cc->pending) {
+            FD_SET(cc->fd, rfds);
+        }
+        if (cc->outlen) {
+            FD_SET(cc->fd, wfds);
+        }
+        if (cc->fd > max) {
+            max = cc->fd;
+        }
+    }
+    return max;
+}
+
+static void
+ctl_serve(fd_set *rfds, fd_set *wfds)
+{
+    int i, fd;
+    ssize_t n;
+    ctl_client_t *cc;
+
+    if (ctl_fd == -1) {
+        return;
+    }
+
+    if (FD_ISSET(ctl_fd, rfds)) {
+        while ((fd = SYS(accept(ctl_fd, NULL, NULL))) != -1) {
+            for (i = 0; i < CTL_CLIENTS && ctl_clients[i].fd != -1; i++) ;
+            if (i == CTL_CLIENTS
+                || SYS(fcntl(fd, F_SETFL,
+                             SYS(fcntl(fd, F_GETFL, 0)) | O_NONBLOCK))) {
+                (void) SYS(close(fd));
+                continue;
+            }
+            ctl_clients[i].fd = fd;
+        }
+    }
+
+    for (i = 0; i < CTL_CLIENTS; i++) {
+        cc = &ctl_clients[i];
+        if (cc->fd == -1) {
+            continue;
+        }
+
+        if (! cc->eof && FD_ISSET(cc->fd, rfds)) {
+            n = SYS(recv(cc->fd, cc->in + cc->inlen,
+                         sizeof(cc->in) - 1 - cc->inlen, 0));
+            if (n == -1) {
+                ctl_close(cc);
+                continue;
+            }
+            if (n == 0) {
+                cc->eof = 1;
+            }
+            cc->inlen += n;
+            cc->in[cc->inlen] = 0;
+            ctl_parse(cc);
+        }
+
+        if (cc->outoff < cc->outlen && FD_ISSET(cc->fd, wfds)) {
+            n = SYS(send(cc->fd, cc->out + cc->outoff,
+                         cc->outlen - cc->outoff, 0));
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                ctl_close(cc);
+                continue;
+            }
+            if (n > 0) {
+                cc->outoff += n;
+            }
+            if (cc->outoff == cc->outlen) {
+                cc->outoff = cc->outlen = 0;
+            }
+        }
+
+        if (cc->eof && ! cc->pending && ! cc->outlen) {
+            ctl_close(cc);
+        }
+    }
+}
+
+static void
+ctl_end(void)
+{
+    int i;
+
+    if (ctl_fd == -1) {
+        return;
+    }
+    for (i = 0; i < CTL_CLIENTS; i++) {
+        if (ctl_clients[i].fd != -1) {
+            ctl_close(&ctl_clients[i]);
+        }
+    }
+    (void) close(ctl_fd);
+    ctl_fd = -1;
+    (void) unlink(ctl_path);
+    free(ctl_path);
+}
+
+/*
+ * Targets are also kept in a hash table indexed by host and port, so
+ * that the control socket can find them without walking the list.
+ * The table doubles whenever it gets as many targets as buckets.
+ */
+
+#define INDEX_MIN		64
+
+static target_t **target_index = NULL;
+static unsigned int index_size = 0;
+static unsigned int index_count = 0;
+
+static unsigned int
+target_hash(const char *host, const char *port)
+{
+    unsigned int h = 2166136261u;	/* FNV-1a */
+    const char *p;
+
+    for (p = host; *p; p++) {
+        h = (h ^ (unsigned char) tolower((unsigned char) *p)) * 16777619u;
+    }
+    h = (h ^ ':') * 16777619u;
+    for (p = port; *p; p++) {
+        h = (h ^ (unsigned char) *p) * 16777619u;
+    }
+    return h;
+}
+
+static void
+index_add(target_t *tp)
+{
+    target_t **old = target_index, *np;
+    unsigned int i, h, size = index_size;
+
+    if (index_count >= index_size) {
+        index_size = index_size ? 2 * index_size : INDEX_MIN;
+        target_index = xcalloc(index_size, sizeof(target_t *));
+        for (i = 0; i < size; i++) {
+            while (old[i]) {
+                np = old[i]->hnext;
+                h = target_hash(old[i]->host, old[i]->port) % index_size;
+                old[i]->hnext = target_index[h];
+                target_index[h] = old[i];
+                old[i] = np;
+            }
+        }
+        free(old);
+    }
+    h = target_hash(tp->host, tp->port) % index_size;
+    tp->hnext = target_index[h];
+    target_index[h] = tp;
+    index_count++;
+}
+
+static void
+index_del(target_t *tp)
+{
+    target_t **pp;
+
+    if (! index_size) {
+        return;
+    }
+    pp = &target_index[target_hash(tp->host, tp->port) % index_size];
+    for (; *pp; pp = &(*pp)->hnext) {
+        if (*pp == tp) {
+            *pp = tp->hnext;
+            index_count--;
+            return;
+        }
+    }
+}
+
+static target_t *
+lookup(const char *host, const char *port)
+{
+    target_t *tp;
+
+    if (! index_size) {
+        return NULL;
+    }
+    tp = target_index[target_hash(host, port) % index_size];
+    for (; tp; tp = tp->hnext) {
+        if (strcasecmp(tp->host, host) == 0 && strcmp(tp->port, port) == 0) {
+            return tp;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Append a new target to our list of targets. We keep track of
+ * the last target added so that we do not have to search for the
+ * end of the list.
+ */
+
+static target_t *last_target = NULL;
+static unsigned int target_id = 0, endpoint_id = 0;
+
+static void
+append(target_t *target)
+{
+    if (target) {
+        if (! targets) {
+            targets = target;
+        } else {
+            last_target->next = target;
+        }
+        last_target = target;
+        index_add(target);
+    }
+}
+
+/*
+ * Remove a target from our list of targets (and the index). The
+ * target itself is not released.
+ */
+
+static void
+detach(target_t *target)
+{
+    target_t **pp, *prev = NULL;
+
+    for (pp = &targets; *pp; prev = *pp, pp = &(*pp)->next) {
+        if (*pp == target) {
+            *pp = target->next;
+            if (last_target == target) {
+                last_target = prev;
+            }
+            target->next = NULL;
+            index_del(target);
+            return;
+        }
+    }
+}
+
+/*
+ * Handler to parse DNS response messages; particularly CNAME
+ * answers. This is used because getaddrinfo(...) and AI_CANONNAME
+ * cannot be used with the glibc version on SamKnows probes. The
+ * version returns PTR entries when asked for a CNAME. Therefore
+ * explicit CNAME query request needs to be made and a handler
+ * function is needed to parse CNAME responses.
+ */
+
+static char*
+parse_cname_response(const u_char* const answer, const int answerlen)
+{
+
+    /* initialize data structure to store the parsed response */
+    ns_msg handle;
+    if (
+	ns_initparse(
+	    answer,     /* answer buffer */
+	    answerlen,  /* true answer length */
+	    &handle     /* data structure filled in by ns_initparse */
+	    ) < 0
+	) {
+	herror("ns_initparse(...)");
+	exit(EXIT_FAILURE);
+    }
+    
+    /* Ideally one would iterate over each resource record returned by
+     * ns_msg_count(...). However, this is a specific parse function for CNAME
+     * records and because a RR cannot have any other records along with a
+     * CNAME [RFC 1912], there is no need to iterate in a loop, but only once,
+     * therefore rrnum is set to 0 */
+    
+    ns_rr rr; int rrnum = 0;
+    
+    /* parse the answer section of the resource record */
+    if (
+	ns_parserr(
+	    &handle, /* data structure filled by ns_initparse */
+	    ns_s_an, /* resource record answer section */
+	    rrnum,   /* resource record index in this section */
+	    &rr      /* data structure filled in by ns_parseerr */
+	    ) < 0
+	) {
+	
+	/* continue to the next resource records if this cannot be parsed */
+	if (errno != ENODEV) {
+	    herror("ns_parserr(...)");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    
+    char* dst = NULL;
+    switch (ns_rr_type(rr)) {
+	
+	/* type: CNAME record */
+    case ns_t_cname:
+	dst = (char *) xcalloc (1, NI_MAXHOST);
+	
+	/* Uncompress the DNS string */
+	if (
+	    ns_name_uncompress(
+		ns_msg_base(handle) /* Message Start */
+		, ns_msg_end(handle)  /* Message End */
+		, ns_rr_rdata(rr)     /* Message Position */
+		, dst                 /* Result */
+		, NI_MAXHOST          /* Result Size */
+		) < 0
+	    ) {
+	    (void) fprintf(stderr, "ns_name_uncompress failed\n");
+	    free(dst); dst = NULL;
+	    exit(EXIT_FAILURE);
+	}
+	
+	break;
+	
+	/* ignore all the other types */
+    default:
+	break;
+    }
+    
+    return dst;
+}
+
+/*
+ * Resolve the host and port name and if successful establish a new
+ * target and create the vector of endpoints we are going to probe
+ * subsequently.
+ */
+
+static target_t*
+expand(const char *host, const char *port)
+{
+    int64_t start = now_us();
+    struct addrinfo hints, *ai_list, *ai;
+    char* canonname = NULL;
+    int n;
+    target_t *tp;
+    endpoint_t *ep;
+
+    assert(host && port);
+
+    /* the coordinator (-D) leaves name resolution to the workers */
+    if (shard_lfd != -1) {
+        tp = xcalloc(1, sizeof(target_t));
+        tp->id = target_id++;
+        tp->host = xstrdup(host);
+        tp->port = xstrdup(port);
+        return tp;
+    }
+
+    PROBE2(expand__start, host, port);
+    prof_enter(PH_EXPAND);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (dmode) {
+	
+	/*  In order to get the CNAME, one can set the AI_CANONNAME
+	 *  flag in hints.ai_flags. However it appears glibc tends to
+	 *  return PTR entries when this flag is turned on (see:
+	 *  http://marc.info/?l=glibc-alpha&m=109239199429843&w=2). The
+	 *  newer versions of glibc have been patched, however the
+	 *  version running on SamKnows probes still has this
+	 *  behavior. As a workaround, we use BIND functions to
+	 *  explicitly send a CNAME query and parse the DNS response
+	 *  ourselves. The answer string is then plugged back into the
+	 *  result structures used below.
+	 */
+
+	/* hints.ai_flags |= AI_CANONNAME; */
+
+	/* list to keep a chain of CNAME strings */
+	short dstset_num = 0;
+	char** dstset = NULL;
+	const char* query_name = host;
 	while (1) {
 	    
 	    /* send a DNS query for CNAME record of the input service name */
@@ -407,837 +3658,4086 @@ expand(const char *host, const char *port)
 		    , answerlen  /* true response len */
 		    );
 	    }
-	    
-	    /* list to keep a chain of CNAME strings */
-	    if (canonname != NULL) {
-		if (dstset_num == 0) {
-		    dstset = xcalloc(dstset_num + 1, sizeof(char*));
-		} else {
-		    dstset = xrealloc(dstset, (dstset_num+1) * sizeof(char*));
-		}
-		dstset[dstset_num] = canonname;
-		dstset_num += 1;
-	 	query_name = canonname;
+	    
+	    /* list to keep a chain of CNAME strings */
+	    if (canonname != NULL) {
+		if (dstset_num == 0) {
+		    dstset = xcalloc(dstset_num + 1, sizeof(char*));
+		} else {
+		    dstset = xrealloc(dstset, (dstset_num+1) * sizeof(char*));
+		}
+		dstset[dstset_num] = canonname;
+		dstset_num += 1;
+	 	query_name = canonname;
+	    }
+	}
+	
+	/* create a string representation of CNAME chains */
+	canonname = NULL;
+	for (int i = 0; i < dstset_num; i++){
+	    char* dangler = canonname;
+	    char* dst = dstset[i];
+	    if (i == 0) {
+		xasprintf(&canonname, "%s", dst);
+		free(dst);
+		continue;
+	    }
+	    if (i == 1) {
+		xasprintf(&canonname, "%s >", dangler);
+		free(dangler); dangler = canonname;
+	    }
+	    if ((i + 1) == dstset_num) {
+		xasprintf(&canonname, "%s %s",dangler,dst);
+	    } else {
+		xasprintf(&canonname, "%s %s >", dangler, dst);
+	    }
+	    if (dst != NULL) { free(dst); dst = NULL; }
+	    if (dangler !=NULL) { free(dangler); dangler = NULL; }
+	}
+	free(dstset); dstset = NULL;
+    }
+
+    tp = xcalloc(1, sizeof(target_t));
+    tp->id = target_id++;
+    tp->host = xstrdup(host);
+    tp->port = xstrdup(port);
+
+    n = getaddrinfo(host, port, &hints, &ai_list);
+    if (n != 0) {
+        fprintf(stderr, "%s: getaddrinfo: %s (skipping %s port %s)\n",
+                progname, gai_strerror(n), host, port);
+	tp->expand_ts = start;
+	tp->expand_dur = now_us() - start;
+	PROBE4(expand__done, host, port, 0, tp->expand_dur);
+	prof_leave();
+	return tp;
+    }
+
+    for (ai = ai_list, tp->num_endpoints = 0;
+         ai; ai = ai->ai_next, tp->num_endpoints++) ;
+    tp->endpoints = xcalloc(1 + tp->num_endpoints, sizeof(endpoint_t));
+
+    for (ai = ai_list, ep = tp->endpoints; ai; ai = ai->ai_next, ep++) {
+	ep->id = endpoint_id++;
+	ep->family = ai->ai_family;
+	ep->socktype = ai->ai_socktype;
+	ep->protocol = ai->ai_protocol;
+	memcpy(&ep->addr, ai->ai_addr, ai->ai_addrlen);
+	ep->addrlen = ai->ai_addrlen;
+	ep->values = pool_alloc(nqueries * sizeof(*ep->values));
+	if (dmode) {
+	    char revname[NI_MAXHOST];
+	    int n;
+	    revname[0] = 0;
+	    if (canonname != NULL) {
+		ep->canonname = xstrdup(canonname);
+	    } else {
+		ep->canonname = xstrdup(host);
+	    }
+
+	    prof_enter(PH_REVERSE);
+	    n = getnameinfo(ai->ai_addr, ai->ai_addrlen,
+			    revname, sizeof(revname), NULL, 0,
+			    NI_NAMEREQD);
+	    prof_leave();
+	    if (n && n != EAI_NONAME) {
+		fprintf(stderr, "%s: getnameinfo: %s\n",
+			progname, gai_strerror(n));
+	    } else {
+		if (strlen(revname)) {
+		    ep->reversename = xstrdup(revname);
+		}
+	    }
+	}
+    }
+
+    freeaddrinfo(ai_list);
+    free(canonname); canonname = NULL;
+
+    tp->expand_ts = start;
+    tp->expand_dur = now_us() - start;
+    PROBE4(expand__done, host, port, tp->num_endpoints, tp->expand_dur);
+    prof_leave();
+
+    return tp;
+}
+
+/*
+ * Generate the file descriptor set for all sockets with a pending
+ * asynchronous connect(). If the struct timeval argument is a valid
+ * pointer, leave the smallest timestamp of a socket with a pending
+ * asynchronous connect in the struct timeval.
+ */
+
+static int
+generate_fdset(target_t *targets, fd_set *fdset, struct timeval *to)
+{
+    int max;
+    target_t *tp;
+    endpoint_t *ep;
+
+    if (to) {
+        timerclear(to);
+    }
+    FD_ZERO(fdset);
+    for (tp = targets, max = -1; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (ep->state == EP_STATE_CONNECTING) {
+                FD_SET(ep->socket, fdset);
+                if (ep->socket > max) {
+                    max = ep->socket;
+                }
+                if (to) {
+                    if (! timerisset(to) || timercmp(&ep->tvs, to, <)) {
+                        *to = ep->tvs;
+                    }
+                }
+            }
+        }
+    }
+
+    return max;
+}
+
+/*
+ * Health scoring (-E). Every endpoint keeps exponentially weighted
+ * moving averages of its latency (successful attempts only) and of its
+ * loss (the ratio of failed and timed out attempts). The weight of a
+ * sample halves after the given number of newer samples. An alert is
+ * raised when an average exceeds its threshold and cleared only when
+ * it falls below HEALTH_HYSTERESIS times the threshold, so that an
+ * average hovering around a threshold does not produce alert storms.
+ */
+
+#define HEALTH_LATENCY		0x01
+#define HEALTH_LOSS		0x02
+
+#define HEALTH_HYSTERESIS	0.8
+
+static int emode = 0;
+static struct {
+    double latency;			/* threshold in us */
+    double loss;			/* threshold ratio */
+    double lat_alpha;			/* EWMA weight of a new sample */
+    double loss_alpha;
+} health;
+
+static void
+health_parse(const char *spec)
+{
+    double v[4] = { 0, 0, 8, 8 };
+    char *s, *p, *endptr;
+    int i;
+
+    s = xstrdup(spec);
+    for (i = 0, p = strtok(s, ":"); p && i < 4; i++, p = strtok(NULL, ":")) {
+        v[i] = strtod(p, &endptr);
+        if (*endptr || v[i] <= 0 || (i >= 2 && v[i] > 1000000)) {
+            break;
+        }
+    }
+    if (i < 2 || p) {
+        fprintf(stderr, "%s: invalid argument '%s' for option -E\n",
+                progname, spec);
+        exit(EXIT_FAILURE);
+    }
+    free(s);
+
+    health.latency = v[0] * 1000;
+    health.loss = v[1] / 100;
+    health.lat_alpha = 1 - pow(0.5, 1 / v[2]);
+    health.loss_alpha = 1 - pow(0.5, 1 / v[3]);
+    emode = 1;
+}
+
+static void
+health_sample(endpoint_t *ep, unsigned int us, int ok)
+{
+    if (! ep->samples++) {
+        ep->loss = ! ok;
+    } else {
+        ep->loss += health.loss_alpha * (! ok - ep->loss);
+    }
+    if (ok) {
+        if (ep->lat == 0) {
+            ep->lat = us;
+        } else {
+            ep->lat += health.lat_alpha * (us - ep->lat);
+        }
+    }
+}
+
+/*
+ * Update the alerts of an endpoint and return those that changed.
+ */
+
+static int
+health_check(endpoint_t *ep)
+{
+    int alerts = ep->alerts, changed;
+
+    if (ep->lat > health.latency) {
+        alerts |= HEALTH_LATENCY;
+    } else if (ep->lat < health.latency * HEALTH_HYSTERESIS) {
+        alerts &= ~HEALTH_LATENCY;
+    }
+    if (ep->loss > health.loss) {
+        alerts |= HEALTH_LOSS;
+    } else if (ep->loss < health.loss * HEALTH_HYSTERESIS) {
+        alerts &= ~HEALTH_LOSS;
+    }
+    changed = alerts ^ ep->alerts;
+    ep->alerts = alerts;
+    return changed;
+}
+
+/*
+ * Change-point detection (-K). A two-sided CUSUM runs over the latency
+ * series of every endpoint. The reference latency of the first regime
+ * is the mean of the first SHIFT_WARMUP successful attempts. Deviations
+ * from the reference exceeding half the minimum shift accumulate, and
+ * once either sum exceeds the limit, the endpoint has moved to a new
+ * regime whose latency is estimated from the samples that contributed
+ * to the sum. The estimate becomes the new reference, so that there is
+ * no need to keep any history and each sample costs O(1).
+ */
+
+#define SHIFT_WARMUP		8
+
+static int kmode = 0;
+static struct {
+    double drift;			/* half the minimum shift in us */
+    double limit;			/* in us */
+} shift;
+
+static void
+shift_parse(const char *spec)
+{
+    double v[2] = { 0, 0 };
+    char *s, *p, *endptr;
+    int i;
+
+    s = xstrdup(spec);
+    for (i = 0, p = strtok(s, ":"); p && i < 2; i++, p = strtok(NULL, ":")) {
+        v[i] = strtod(p, &endptr);
+        if (*endptr || v[i] <= 0) {
+            break;
+        }
+    }
+    if (i < 1 || p) {
+        fprintf(stderr, "%s: invalid argument '%s' for option -K\n",
+                progname, spec);
+        exit(EXIT_FAILURE);
+    }
+    free(s);
+
+    shift.drift = v[0] * 1000 / 2;
+    shift.limit = (i == 2 ? v[1] : 4 * v[0]) * 1000;
+    kmode = 1;
+}
+
+static void
+shift_sample(endpoint_t *ep, unsigned int us)
+{
+    double to;
+
+    if (ep->warmup < SHIFT_WARMUP) {
+        ep->ref += (us - ep->ref) / ++ep->warmup;
+        return;
+    }
+
+    ep->pos += us - ep->ref - shift.drift;
+    ep->pos_n++;
+    if (ep->pos <= 0) {
+        ep->pos = ep->pos_n = 0;
+    }
+    ep->neg += ep->ref - us - shift.drift;
+    ep->neg_n++;
+    if (ep->neg <= 0) {
+        ep->neg = ep->neg_n = 0;
+    }
+
+    if (ep->pos > shift.limit) {
+        to = ep->ref + shift.drift + ep->pos / ep->pos_n;
+    } else if (ep->neg > shift.limit) {
+        to = ep->ref - shift.drift - ep->neg / ep->neg_n;
+        if (to < 0) {
+            to = 0;
+        }
+    } else {
+        return;
+    }
+
+    if (! ep->shifted) {
+        ep->shift_from = ep->ref;
+        ep->shifted = 1;
+    }
+    ep->shift_to = to;
+    ep->ref = to;
+    ep->pos = ep->neg = 0;
+    ep->pos_n = ep->neg_n = 0;
+}
+
+/*
+ * Rotating sampling (-F). Only a fraction of the targets is probed in
+ * each round. The targets are split into K strata by their ids, with
+ * K the smallest number of rounds in which the fraction covers all
+ * targets, and every round probes the next stratum in turn, so that
+ * no target goes unprobed for more than K rounds. The rest of the
+ * budget of the round goes to the other targets with the highest
+ * priority: the number of rounds since they were last probed,
+ * weighted up by the uncertainty of their latency estimate (the
+ * coefficient of variation, 1 while there are fewer than two samples).
+ * The candidates are picked with a bounded min-heap, so a round costs
+ * O(N log B) for N targets and a budget of B.
+ */
+
+static target_t **sample_heap = NULL;
+static size_t sample_heap_size = 0;
+
+static void
+sample_parse(const char *arg)
+{
+    char *endptr;
+
+    fraction = strtod(arg, &endptr) / 100;
+    if (*endptr || fraction <= 0 || fraction > 1) {
+        fprintf(stderr, "%s: invalid argument '%s' for option -F\n",
+                progname, arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void
+sample_account(target_t *tp, unsigned int us, int ok)
+{
+    double d;
+
+    if (! ok) {
+        return;
+    }
+    tp->n++;
+    d = us - tp->mean;
+    tp->mean += d / tp->n;
+    tp->m2 += d * (us - tp->mean);
+}
+
+static void
+sample_sift(size_t i, size_t n)
+{
+    target_t *tp = sample_heap[i];
+    size_t c;
+
+    while ((c = 2 * i + 1) < n) {
+        if (c + 1 < n && sample_heap[c + 1]->score < sample_heap[c]->score) {
+            c++;
+        }
+        if (tp->score <= sample_heap[c]->score) {
+            break;
+        }
+        sample_heap[i] = sample_heap[c];
+        i = c;
+    }
+    sample_heap[i] = tp;
+}
+
+/*
+ * Select the targets of the given round (counting from 1).
+ */
+
+static void
+sample(target_t *targets, unsigned long round)
+{
+    target_t *tp;
+    size_t num = 0, budget, k, n = 0, i, j;
+    double cv;
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        tp->selected = 0;
+        num++;
+    }
+    budget = (size_t) ceil(fraction * num);
+    k = (size_t) ceil(1 / fraction);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (tp->id % k == round % k) {
+            tp->selected = 1;
+            if (budget) {
+                budget--;
+            }
+        }
+    }
+
+    if (budget > sample_heap_size) {
+        sample_heap = xrealloc(sample_heap, budget * sizeof(*sample_heap));
+        sample_heap_size = budget;
+    }
+    for (tp = targets; budget && target_valid(tp); tp = tp->next) {
+        if (tp->selected) {
+            continue;
+        }
+        cv = 1;
+        if (tp->n >= 2 && tp->mean > 0) {
+            cv = sqrt(tp->m2 / (tp->n - 1)) / tp->mean;
+            if (cv > 1) {
+                cv = 1;
+            }
+        }
+        tp->score = (round - tp->last) * (1 + cv);
+        if (n < budget) {
+            sample_heap[n++] = tp;
+            if (n == budget) {
+                for (i = n / 2; i-- > 0; ) {
+                    sample_sift(i, n);
+                }
+            }
+        } else if (tp->score > sample_heap[0]->score) {
+            sample_heap[0] = tp;
+            sample_sift(0, n);
+        }
+    }
+    for (j = 0; j < n; j++) {
+        sample_heap[j]->selected = 1;
+    }
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (tp->selected) {
+            tp->last = round;
+            tp->probed = 1;
+        }
+    }
+}
+
+/*
+ * Scheduling classes. Targets read from a file (-f) or added over the
+ * control socket (-C) may come with an interval of their own, say 10
+ * seconds for our own services and an hour for the rest; all others
+ * are due in every run (-i). A run only probes the targets that are
+ * due, in the order of their class (the shortest interval first) and,
+ * within a class, of how long they are overdue. With a probe budget
+ * (-B) a run starts at most rate times interval connects; once the
+ * budget is exhausted the remaining targets are deferred to the next
+ * run, where they go first in their class. The high priority classes
+ * thus keep their cadence however long the list grows. The cadence of
+ * a target is kept in phase unless it falls behind by a whole
+ * interval, and it cannot be finer than the run interval.
+ */
+
+static target_t **sched_list = NULL;
+static size_t sched_size = 0;
+
+static void
+sched_parse(const char *arg)
+{
+    char *endptr;
+
+    rate = strtod(arg, &endptr);
+    if (*endptr || rate <= 0) {
+        fprintf(stderr, "%s: invalid argument '%s' for option -B\n",
+                progname, arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static unsigned int
+sched_every(const target_t *tp)
+{
+    return tp->every ? tp->every : interval;
+}
+
+static int
+sched_cmp(const void *a, const void *b)
+{
+    const target_t *x = *(target_t * const *) a;
+    const target_t *y = *(target_t * const *) b;
+
+    if (sched_every(x) != sched_every(y)) {
+        return sched_every(x) < sched_every(y) ? -1 : 1;
+    }
+    if (x->due != y->due) {
+        return x->due < y->due ? -1 : 1;
+    }
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/*
+ * Select the targets of the next run. Returns the number of targets
+ * selected; the first due target is always selected, even if it alone
+ * exceeds the budget.
+ */
+
+static size_t
+schedule(target_t *targets)
+{
+    target_t *tp;
+    size_t num = 0, n = 0, i;
+    int64_t now = now_us(), every;
+    double allowance = rate * interval / 1000;
+    double cost;
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        tp->selected = 0;
+        num++;
+    }
+    if (num > sched_size) {
+        sched_list = xrealloc(sched_list, num * sizeof(*sched_list));
+        sched_size = num;
+    }
+
+    /* runs do not start exactly on time, hence half an interval slack */
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (tp->due <= now + interval * 500LL) {
+            sched_list[n++] = tp;
+        }
+    }
+    qsort(sched_list, n, sizeof(*sched_list), sched_cmp);
+
+    for (i = 0; i < n; i++) {
+        tp = sched_list[i];
+        cost = (double) tp->num_endpoints * nqueries;
+        if (rate && i && cost > allowance) {
+            break;
+        }
+        allowance -= cost;
+        every = sched_every(tp) * 1000LL;
+        tp->due = (tp->due + every > now) ? tp->due + every : now + every;
+        tp->selected = 1;
+        tp->probed = 1;
+    }
+    return i;
+}
+
+/*
+ * Account a finished connection attempt. Successful attempts are
+ * recorded with the time it took to establish the connection in
+ * microseconds, failed or timed out attempts with the negated time.
+ */
+
+static void
+account(endpoint_t *ep, unsigned int us, int ok)
+{
+    if (ok) {
+        ep->values[ep->idx] = us;
+        ep->sum += us;
+        ep->tot++;
+    } else {
+        ep->values[ep->idx] = -us;
+    }
+    ep->cnt++;
+    ep->idx++;
+    if (emode) {
+        health_sample(ep, us, ok);
+    }
+    if (kmode && ok) {
+        shift_sample(ep, us);
+    }
+}
+
+/*
+ * Give up on all connection attempts still in flight. They are not
+ * accounted, hence the endpoints have one result less for this round.
+ */
+
+static void
+abandon(target_t *targets)
+{
+    target_t *tp;
+    endpoint_t *ep;
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (ep->state == EP_STATE_CONNECTING) {
+                (void) SYS(close(ep->socket));
+                ep->socket = 0;
+                ep->state = EP_STATE_FAILED;
+                engine.connecting--;
+                coord_release();
+            }
+        }
+    }
+}
+
+/*
+ * Result cache (-X). Instances sharing a cache file publish every
+ * connection attempt they finish, keyed by address and port, and take
+ * the result of an attempt another instance finished within the last
+ * maxage milliseconds instead of connecting themselves. The file is a
+ * fixed table of slots mapped into all instances; a key is looked for
+ * in CACHE_PROBE consecutive slots and replaces the oldest of them.
+ * Like the live statistics (-S), every slot is protected by a sequence
+ * counter: a writer claims a slot by making its counter odd with a
+ * compare-and-swap, and skips the slot if another writer holds it,
+ * while readers copy the slot and retry until they observe the same
+ * even counter before and after. Results of our own instance are never
+ * taken, and a cached result is taken only once per endpoint, since
+ * the rounds of a run are meant to measure again.
+ */
+
+#define CACHE_MAGIC		0x48415058	/* "HAPX" */
+#define CACHE_VERSION		1
+#define CACHE_SLOTS		8192
+#define CACHE_PROBE		8
+#define CACHE_RETRIES		64
+#define CACHE_TIMEOUT		-1	/* err of a timed out attempt */
+
+typedef struct cache_slot {
+    uint32_t seq;			/* odd while being written */
+    uint16_t family;			/* 0 if unused */
+    uint16_t port;			/* network byte order */
+    uint8_t addr[16];
+    int64_t ts;				/* us since the epoch */
+    int64_t pid;			/* instance that measured */
+    uint32_t us;
+    int32_t err;			/* SO_ERROR or CACHE_TIMEOUT */
+} cache_slot_t;
+
+typedef struct cache {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    cache_slot_t slot[];
+} cache_t;
+
+#define CACHE_KEY(s)		((const void *) &(s)->family)
+#define CACHE_KEYLEN		(2 + 2 + 16)
+
+static cache_t *cache = NULL;
+static unsigned int cache_age = 1000;	/* in ms */
+
+static void
+cache_open(const char *spec)
+{
+    char *file, *p, *endptr;
+    long num;
+    int fd, i, created = 1;
+    struct stat st;
+    size_t size = sizeof(cache_t) + CACHE_SLOTS * sizeof(cache_slot_t);
+    uint32_t magic;
+
+    file = xstrdup(spec);
+    p = strrchr(file, ':');
+    if (p) {
+        *p++ = 0;
+        num = strtol(p, &endptr, 10);
+        if (num <= 0 || num > INT_MAX || *endptr || ! *file) {
+            fprintf(stderr, "%s: invalid argument '%s' for option -X\n",
+                    progname, spec);
+            exit(EXIT_FAILURE);
+        }
+        cache_age = num;
+    }
+
+    fd = open(file, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd == -1 && errno == EEXIST) {
+        created = 0;
+        fd = open(file, O_RDWR);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "%s: open: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (created && ftruncate(fd, size) == -1) {
+        fprintf(stderr, "%s: ftruncate: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    /* the creator may not have sized the file yet, a file of any
+     * other size is left alone */
+    for (i = 0; ! created; i++) {
+        if (fstat(fd, &st) == -1) {
+            fprintf(stderr, "%s: fstat: %s\n", progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (st.st_size == (off_t) size) {
+            break;
+        }
+        if (st.st_size > (off_t) size || i == 100) {
+            fprintf(stderr, "%s: %s: not a compatible cache\n",
+                    progname, file);
+            exit(EXIT_FAILURE);
+        }
+        usleep(10000);
+    }
+    cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cache == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    (void) close(fd);
+
+    if (created) {
+        cache->version = CACHE_VERSION;
+        cache->slots = CACHE_SLOTS;
+        cache->slot_size = sizeof(cache_slot_t);
+        __atomic_store_n(&cache->magic, CACHE_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        for (i = 0; (magic = __atomic_load_n(&cache->magic,
+                                             __ATOMIC_ACQUIRE)) == 0; i++) {
+            if (i == 100) {
+                break;
+            }
+            usleep(10000);
+        }
+        if (magic != CACHE_MAGIC || cache->version != CACHE_VERSION
+            || cache->slots != CACHE_SLOTS
+            || cache->slot_size != sizeof(cache_slot_t)) {
+            fprintf(stderr, "%s: %s: not a compatible cache\n",
+                    progname, file);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(file);
+}
+
+static int
+cache_key(const endpoint_t *ep, cache_slot_t *key)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) &ep->addr;
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) &ep->addr;
+
+    memset(key, 0, sizeof(*key));
+    switch (ep->family) {
+    case AF_INET:
+        key->port = sin->sin_port;
+        memcpy(key->addr, &sin->sin_addr, sizeof(sin->sin_addr));
+        break;
+    case AF_INET6:
+        key->port = sin6->sin6_port;
+        memcpy(key->addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+        break;
+    default:
+        return -1;
+    }
+    key->family = ep->family;
+    return 0;
+}
+
+static uint32_t
+cache_hash(const cache_slot_t *key)
+{
+    const unsigned char *p = CACHE_KEY(key);
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < CACHE_KEYLEN; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Look up a result another instance finished within the maximum age.
+ * Returns 1 and a copy of the slot if there is one.
+ */
+
+static int
+cache_get(const endpoint_t *ep, cache_slot_t *copy)
+{
+    cache_slot_t key, *slot;
+    uint32_t h, s1, s2;
+    int64_t now;
+    int i, n;
+
+    if (cache_key(ep, &key) == -1) {
+        return 0;
+    }
+    h = cache_hash(&key);
+    now = now_us();
+    for (i = 0; i < CACHE_PROBE; i++) {
+        slot = &cache->slot[(h + i) % CACHE_SLOTS];
+        /* a writer that died halfway leaves the slot odd for good */
+        for (n = 0; n < CACHE_RETRIES; n++) {
+            s1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            memcpy(copy, slot, sizeof(*copy));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            s2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+            if (! (s1 & 1) && s1 == s2) {
+                break;
+            }
+        }
+        if (n == CACHE_RETRIES
+            || memcmp(CACHE_KEY(copy), CACHE_KEY(&key), CACHE_KEYLEN)) {
+            continue;
+        }
+        return (copy->pid != getpid() && copy->ts != ep->cache_ts
+                && copy->ts <= now && now - copy->ts <= cache_age * 1000LL);
+    }
+    return 0;
+}
+
+/*
+ * Publish a finished connection attempt.
+ */
+
+static void
+cache_put(const endpoint_t *ep, const struct timeval *tv,
+          unsigned int us, int err)
+{
+    cache_slot_t key, *slot, *victim = NULL;
+    uint32_t h, seq;
+    int i;
+
+    if (! cache || cache_key(ep, &key) == -1) {
+        return;
+    }
+    h = cache_hash(&key);
+    for (i = 0; i < CACHE_PROBE; i++) {
+        slot = &cache->slot[(h + i) % CACHE_SLOTS];
+        if (! slot->family
+            || ! memcmp(CACHE_KEY(slot), CACHE_KEY(&key), CACHE_KEYLEN)) {
+            victim = slot;
+            break;
+        }
+        if (! victim || slot->ts < victim->ts) {
+            victim = slot;
+        }
+    }
+
+    seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+    if ((seq & 1)
+        || ! __atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, 0,
+                                         __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((void *) CACHE_KEY(victim), CACHE_KEY(&key), CACHE_KEYLEN);
+    victim->ts = tv2us(tv);
+    victim->pid = getpid();
+    victim->us = us;
+    victim->err = err;
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take the result of an endpoint from the cache instead of connecting.
+ * Results that would have timed out with our timeout count as
+ * timeouts; timeouts shorter than ours tell nothing and are ignored.
+ * Returns 1 if the endpoint has its result.
+ */
+
+static int
+cache_use(target_t *tp, endpoint_t *ep)
+{
+    cache_slot_t c;
+    struct timeval tv;
+    unsigned int us;
+    int ok, timedout;
+
+    if (! cache || pmode || ! cache_get(ep, &c)) {
+        return 0;
+    }
+    timedout = (c.err == CACHE_TIMEOUT || c.us >= timeout * 1000);
+    if (c.err == CACHE_TIMEOUT && c.us < timeout * 1000) {
+        return 0;
+    }
+    us = (timedout && c.err != CACHE_TIMEOUT) ? timeout * 1000 : c.us;
+    ok = ! timedout && ! c.err;
+
+    (void) gettimeofday(&tv, NULL);
+    ep->tvs = tv;
+    ep->cache_ts = c.ts;
+    account(ep, us, ok);
+    if (timedout) {
+        post_event(EV_TIMEOUT, tp, ep, &tv, us, 0);
+        ep->state = EP_STATE_TIMEDOUT;
+    } else {
+        post_event(EV_DONE, tp, ep, &tv, us, c.err);
+        ep->state = EP_STATE_CONNECTED;
+    }
+    engine.cached++;
+    live_sample(ep, &tv, us, ok, timedout);
+    metrics_sample(tp, ep, us, ok, timedout);
+    if (fraction) {
+        sample_account(tp, us, ok);
+    }
+    if (umode) {
+        rollup_sample(ep, &tv, us, ok);
+    }
+    return 1;
+}
+
+/*
+ * Go through all endpoints and check which ones have timed out, for
+ * which ones the asynchronous connect() has finished and update the
+ * stats accordingly.
+ */
+
+static void
+update(target_t *targets, fd_set *fdset)
+{
+    struct timeval tv, td;
+    int soerror;
+    socklen_t soerrorlen = sizeof(soerror);
+    target_t *tp;
+    endpoint_t *ep;
+    unsigned int us;
+
+    assert(targets && fdset);
+
+    (void) gettimeofday(&tv, NULL);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            /* calculate time since we started the connect */
+            timersub(&tv, &ep->tvs, &td);
+            us = td.tv_sec*1000000 + td.tv_usec;
+            if (ep->state == EP_STATE_CONNECTING && us >= timeout * 1000) {
+                PROBE3(connect__timeout, ep->id, ep->family, us);
+                account(ep, us, 0);
+                post_event(EV_TIMEOUT, tp, ep, &tv, us, 0);
+                (void) SYS(close(ep->socket));
+                ep->socket = 0;
+                ep->state = EP_STATE_TIMEDOUT;
+                engine.connecting--;
+                coord_release();
+                cache_put(ep, &tv, us, CACHE_TIMEOUT);
+                live_sample(ep, &tv, us, 0, 1);
+                metrics_sample(tp, ep, us, 0, 1);
+                if (umode) {
+                    rollup_sample(ep, &tv, us, 0);
+                }
+                continue;
+            }
+            if (ep->state == EP_STATE_CONNECTING
+                && FD_ISSET(ep->socket, fdset)) {
+                if (-1 == SYS(getsockopt(ep->socket, SOL_SOCKET, SO_ERROR,
+                                         &soerror, &soerrorlen))) {
+                    diag_die(HAPPY_DIAG_GETSOCKOPT, ep);
+                }
+                PROBE4(connect__done, ep->id, ep->family, us, soerror);
+                account(ep, us, ! soerror);
+                post_event(EV_DONE, tp, ep, &tv, us, soerror);
+                if (! pmode) {
+                    (void) SYS(close(ep->socket));
+                    ep->socket = 0;
+                }
+                ep->state = EP_STATE_CONNECTED;
+                engine.connecting--;
+                coord_release();
+                cache_put(ep, &tv, us, soerror);
+                live_sample(ep, &tv, us, ! soerror, 0);
+                metrics_sample(tp, ep, us, ! soerror, 0);
+                if (fraction) {
+                    sample_account(tp, us, ! soerror);
+                }
+                if (umode) {
+                    rollup_sample(ep, &tv, us, ! soerror);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * For all endpoints, create a socket and start a non-blocking
+ * connect(). In order to avoid creating bursts of TCP SYN packets,
+ * we take a short nap before each connect() call. Note that
+ * asynchronous connect()s might actually succeed during the
+ * short nap.
+ */
+
+static void
+prepare(target_t *targets)
+{
+    int rc, flags, paced;
+    fd_set fdset, rfds;
+    target_t *tp;
+    endpoint_t *ep;
+    struct timeval dts, dtn, dtd, dd;
+    int64_t wait;
+
+    assert(targets);
+
+    dd.tv_sec = delay / 1000;
+    dd.tv_usec = (delay % 1000) * 1000;
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (target_scheduled() && ! tp->selected) {
+            continue;
+        }
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+
+            if (stopping) {
+                return;
+            }
+
+            if (cache_use(tp, ep)) {
+                continue;
+            }
+
+            /* wait for our own delay and then for the host-wide
+             * budget (-G) */
+            if (delay || coord) {
+                int max;
+                struct timeval to;
+
+                (void) gettimeofday(&dts, NULL);
+                prof_enter(PH_PACING);
+
+                while (1) {
+                    max = generate_fdset(targets, &fdset, NULL);
+                    max = metrics_fdset(&rfds, &fdset, max);
+                    max = ctl_fdset(&rfds, &fdset, max);
+
+                    (void) gettimeofday(&dtn, NULL);
+                    timersub(&dtn, &dts, &dtd);
+                    paced = ! delay || timercmp(&dd, &dtd, <);
+                    if (stopping || (paced && coord_acquire(&wait))) {
+                        break;
+                    }
+
+                    if (paced) {
+                        to.tv_sec = wait / 1000000;
+                        to.tv_usec = wait % 1000000;
+                    } else {
+                        timeradd(&dts, &dd, &to);
+                        timersub(&to, &dtn, &to);
+                    }
+                    rc = SYS(select(1 + max, &rfds, &fdset, NULL, &to));
+                    engine.selects++;
+                    if (rc == -1) {
+                        if (errno != EINTR) {
+                            diag_die(HAPPY_DIAG_SELECT, NULL);
+                        }
+                        FD_ZERO(&rfds);
+                        FD_ZERO(&fdset);
+                    }
+                    update(targets, &fdset);
+                    metrics_serve(&rfds, &fdset);
+                    ctl_serve(&rfds, &fdset);
+                }
+                prof_leave();
+                post_span("nap", NULL, NULL, NULL, tv2us(&dts), 0, 0);
+                if (stopping) {
+                    return;
+                }
+            }
+
+            ep->socket = SYS(socket(ep->family, ep->socktype, ep->protocol));
+            if (ep->socket < 0) {
+                coord_release();
+                switch (errno) {
+                    case EAFNOSUPPORT:
+                    case EPROTONOSUPPORT:
+                        continue;
+
+                    default:
+                        post_event(EV_FAIL, tp, ep, NULL, 0, errno);
+                        diag_record(HAPPY_DIAG_SOCKET, ep, 0);
+                        ep->socket = 0;
+                        ep->state = EP_STATE_FAILED;
+                        continue;
+                }
+            }
+
+            flags = SYS(fcntl(ep->socket, F_GETFL, 0));
+            if (SYS(fcntl(ep->socket, F_SETFL, flags | O_NONBLOCK)) == -1) {
+                diag_record(HAPPY_DIAG_FCNTL, ep, 0);
+                coord_release();
+                (void) SYS(close(ep->socket));
+                ep->socket = 0;
+                ep->state = EP_STATE_FAILED;
+                continue;
+            }
+
+            if (SYS(connect(ep->socket,
+                            (struct sockaddr *) &ep->addr,
+                            ep->addrlen)) == -1) {
+                if (errno != EINPROGRESS) {
+                    post_event(EV_FAIL, tp, ep, NULL, 0, errno);
+                    diag_record(HAPPY_DIAG_CONNECT, ep, 0);
+                    coord_release();
+                    (void) SYS(close(ep->socket));
+                    ep->socket = 0;
+                    ep->state = EP_STATE_FAILED;
+                    continue;
+                }
+            }
+
+            ep->state = EP_STATE_CONNECTING;
+            engine.connecting++;
+            engine.connects++;
+            (void) gettimeofday(&ep->tvs, NULL);
+            PROBE2(connect__start, ep->id, ep->family);
+            post_event(EV_CONNECT, tp, ep, &ep->tvs, 0, 0);
+        }
+    }
+}
+
+
+/*
+ * Wait in a select() loop for any pending connect() requests to
+ * complete. If the connect() was successful, collect basic timing
+ * statistics.
+ */
+
+static void
+collect(target_t *targets)
+{
+    int rc, max;
+    fd_set fdset, rfds;
+    struct timeval to, ts, tn, grace;
+    int64_t due = 0;
+
+    assert(targets);
+
+    while (1) {
+
+        if (timeout) {
+            to.tv_sec = timeout / 1000;
+            to.tv_usec = (timeout % 1000) * 1000;
+        }
+
+        max = generate_fdset(targets, &fdset, timeout ? &ts : NULL);
+        if (max == -1) {
+            break;
+        }
+        max = metrics_fdset(&rfds, &fdset, max);
+        max = ctl_fdset(&rfds, &fdset, max);
+
+        if (timeout) {
+            (void) gettimeofday(&tn, NULL);
+            timeradd(&ts, &to, &to);
+            timersub(&to, &tn, &to);
+        }
+
+        /* when stopping, wait a bounded time and then abandon the
+         * connection attempts still in flight */
+        if (stopping) {
+            if (! due) {
+                due = now_us() + STOP_GRACE * 1000LL;
+            }
+            if (now_us() >= due) {
+                abandon(targets);
+                break;
+            }
+            grace.tv_sec = (due - now_us()) / 1000000;
+            grace.tv_usec = (due - now_us()) % 1000000;
+            if (! timeout || timercmp(&grace, &to, <)) {
+                to = grace;
+            }
+        }
+
+        rc = SYS(select(1 + max, &rfds, &fdset, NULL,
+                        (timeout || stopping) ? &to : NULL));
+        engine.selects++;
+        if (rc == -1) {
+            if (errno != EINTR) {
+                diag_die(HAPPY_DIAG_SELECT, NULL);
+            }
+            FD_ZERO(&rfds);
+            FD_ZERO(&fdset);
+        }
+
+        update(targets, &fdset);
+        metrics_serve(&rfds, &fdset);
+        ctl_serve(&rfds, &fdset);
+    }
+}
+
+/*
+ * Sort the results for each target. This is in particular useful for
+ * interactive usage.
+ */
+
+static int
+cmp(const void *a, const void *b)
+{
+    endpoint_t *pa = (endpoint_t *) a;
+    endpoint_t *pb = (endpoint_t *) b;
+
+    if (! pa->tot || ! pb->tot) {
+        return 0;
+    }
+
+    if (pa->sum/pa->tot < pb->sum/pb->tot) {
+        return -1;
+    } else if (pa->sum/pa->tot > pb->sum/pb->tot) {
+        return 1;
+    }
+    return 0;
+}
+
+static void
+sort(target_t *targets)
+{
+    target_t *tp;
+    endpoint_t *ep;
+
+    assert(targets);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (tp->endpoints) {
+            qsort(tp->endpoints, tp->num_endpoints, sizeof(*ep), cmp);
+        }
+    }
+}
+
+/*
+ * Report the results. For each endpoint of a target, we show the time
+ * measured to establish a connection. This default format is intended
+ * primarily for human readers.
+ */
+
+static void
+report(target_t *targets, FILE *out)
+{
+    int i, n, len;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    int first = 1;
+
+    assert(targets);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (! target_probed(tp)) {
+            continue;
+        }
+
+        fprintf(out, "%s%s:%s\n",
+                first ? "" : "\n", tp->host, tp->port);
+        first = 0;
+
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+            fprintf(out, " %s%n", host, &len);
+            fprintf(out, "%*s", (42-len), "");
+            for (i = 0; i < ep->idx; i++) {
+                if (ep->values[i] >= 0) {
+                    fprintf(out, " %4u.%03u",
+                            ep->values[i] / 1000,
+                            ep->values[i] % 1000);
+                } else {
+                    fprintf(out, "     *   ");
+                }
+            }
+            fprintf(out, "\n");
+        }
+    }
+}
+
+/*
+ * Report the pump results. For each endpoint of a target, we show the
+ * bytes/seconds send and received.
+ */
+
+static void
+report_pump(target_t *targets, FILE *out)
+{
+    int n, len;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    int first = 1;
+
+    assert(targets);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (! target_probed(tp)) {
+            continue;
+        }
+
+        fprintf(out, "%s%s:%s\n",
+                first ? "" : "\n", tp->host, tp->port);
+        first = 0;
+
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+            fprintf(out, " %s%n", host, &len);
+            fprintf(out, "%*s", (42-len), "");
+            fprintf(out, " %4u.%03u [sent]",
+                    ep->send / pump_timeout * 1000 / 1000,
+                    ep->send / pump_timeout * 1000 % 1000);
+            fprintf(out, " %4u.%03u [rcvd]",
+                    ep->rcvd / pump_timeout * 1000 / 1000,
+                    ep->rcvd / pump_timeout * 1000 % 1000);
+            fprintf(out, "\n");
+        }
+    }
+}
+
+/*
+ * Report the dns results. For each endpoint of a target, we show the
+ * canonical name and the reverse name.
+ */
+
+static void
+report_dns(target_t *targets, FILE *out)
+{
+    int n, len;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    int first = 1;
+
+    assert(targets);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (! target_probed(tp)) {
+            continue;
+        }
+
+	fprintf(out, "%s%s:%s\n",
+		first ? "" : "\n", tp->host, tp->port);
+	first = 0;
+
+	for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+	    n = getnameinfo((struct sockaddr *) &ep->addr,
+			    ep->addrlen,
+			    host, sizeof(host), serv, sizeof(serv),
+			    NI_NUMERICHOST | NI_NUMERICSERV);
+	    if (n) {
+		fprintf(stderr, "%s: getnameinfo: %s\n",
+			progname, gai_strerror(n));
+		continue;
+	    }
+	    fprintf(out, " %s > %s%n", ep->canonname, host, &len);
+	    if (ep->reversename) {
+		fprintf(out, " > %s", ep->reversename);
+	    }
+	    fprintf(out, "\n");
+	}
+    }
+}
+
+/*
+ * Report the results. This function produces a more compact semicolon
+ * separated output format intended for consumption by other programs.
+ */
+
+static void
+report_sk(target_t *targets, FILE *out)
+{
+    int i, n;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    time_t now;
+
+    assert(targets);
+
+    now = time(NULL);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (! target_probed(tp)) {
+            continue;
+        }
+
+	if (! tp->endpoints) {
+            fprintf(out, "HAPPY.0.4;%lu;%s;%s;%s\n",
+                    now, "FAIL", tp->host, tp->port);
+	}
+
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+
+            fprintf(out, "HAPPY.0.4;%lu;%s;%s;%s;%s",
+                    now, ep->cnt ? "OK" : "FAIL", tp->host, tp->port, host);
+            for (i = 0; i < ep->idx; i++) {
+                fprintf(out, ";%d", ep->values[i]);
+            }
+            fprintf(out, "\n");
+        }
+    }
+}
+
+/*
+ * Report the pump results. This function produces a more compact
+ * semicolon separated output format intended for consumption by other
+ * programs.
+ */
+
+static void
+report_pump_sk(target_t *targets, FILE *out)
+{
+    int n;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    time_t now;
+
+    assert(targets);
+
+    now = time(NULL);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (! target_probed(tp)) {
+            continue;
+        }
+
+	if (! tp->endpoints) {
+            fprintf(out, "PUMP.0.4;%lu;%s;%s;%s\n",
+                    now, "FAIL", tp->host, tp->port);
+	}
+
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+
+            fprintf(out, "PUMP.0.4;%lu;%s;%s;%s;%s",
+                    now, ep->cnt ? "OK" : "FAIL", tp->host, tp->port, host);
+            fprintf(out, ";%u.%03u",
+                    ep->send / pump_timeout * 1000 / 1000,
+                    ep->send / pump_timeout * 1000 % 1000);
+            fprintf(out, ";%u.%03u",
+                    ep->rcvd / pump_timeout * 1000 / 1000,
+                    ep->rcvd / pump_timeout * 1000 % 1000);
+            fprintf(out, "\n");
+        }
+    }
+}
+
+/*
+ * Report the dns results. This function produces a more compact
+ * semicolon separated output format intended for consumption by other
+ * programs.
+ */
+
+static void
+report_dns_sk(target_t *targets, FILE *out)
+{
+    int n;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    time_t now;
+
+    assert(targets);
+
+    now = time(NULL);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (! target_probed(tp)) {
+            continue;
+        }
+
+	if (! tp->endpoints) {
+            fprintf(out, "DNS.0.4;%lu;%s;%s;%s\n",
+                    now, "FAIL", tp->host, tp->port);
+	}
+
+	for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+
+	    n = getnameinfo((struct sockaddr *) &ep->addr,
+			    ep->addrlen,
+			    host, sizeof(host), serv, sizeof(serv),
+			    NI_NUMERICHOST | NI_NUMERICSERV);
+	    if (n) {
+		fprintf(stderr, "%s: getnameinfo: %s\n",
+			progname, gai_strerror(n));
+		continue;
 	    }
+
+	    fprintf(out, "DNS.0.4;%lu;%s;%s;%s;%s;%s",
+		    now, ep->cnt ? "OK" : "FAIL", tp->host, host,
+		    ep->canonname ? ep->canonname : "",
+		    ep->reversename ? ep->reversename : "");
+	    fprintf(out, "\n");
+	}
+    }
+}
+
+/*
+ * Report the health alerts (-E) that were raised or cleared since the
+ * previous report. Endpoints without changes are not shown at all.
+ */
+
+static void
+report_health(target_t *targets, FILE *out)
+{
+    int n, len, changed, bit;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+
+    assert(targets);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            changed = health_check(ep);
+            if (! changed) {
+                continue;
+            }
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+            for (bit = HEALTH_LATENCY; bit <= HEALTH_LOSS; bit <<= 1) {
+                if (! (changed & bit)) {
+                    continue;
+                }
+                fprintf(out, "%s:%s %s%n", tp->host, tp->port, host, &len);
+                fprintf(out, "%*s", len < 42 ? 42 - len : 0, "");
+                fprintf(out, " %-7s %-7s %4u.%03u %5.1f%%\n",
+                        bit == HEALTH_LATENCY ? "latency" : "loss",
+                        (ep->alerts & bit) ? "raised" : "cleared",
+                        (unsigned) ep->lat / 1000, (unsigned) ep->lat % 1000,
+                        ep->loss * 100);
+            }
+        }
+    }
+}
+
+/*
+ * Report the health alerts (-E). This function produces a more compact
+ * semicolon separated output format intended for consumption by other
+ * programs.
+ */
+
+static void
+report_health_sk(target_t *targets, FILE *out)
+{
+    int n, changed, bit;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    time_t now;
+
+    assert(targets);
+
+    now = time(NULL);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            changed = health_check(ep);
+            if (! changed) {
+                continue;
+            }
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+            for (bit = HEALTH_LATENCY; bit <= HEALTH_LOSS; bit <<= 1) {
+                if (! (changed & bit)) {
+                    continue;
+                }
+                fprintf(out, "ALERT.0.4;%lu;%s;%s;%s;%s;%s;%u;%.1f\n",
+                        now, (ep->alerts & bit) ? "RAISE" : "CLEAR",
+                        bit == HEALTH_LATENCY ? "latency" : "loss",
+                        tp->host, tp->port, host,
+                        (unsigned) ep->lat, ep->loss * 100);
+            }
+        }
+    }
+}
+
+/*
+ * Report the latency regime shifts (-K) detected since the previous
+ * report, with the latencies before and after the shift.
+ */
+
+static void
+report_shift(target_t *targets, FILE *out)
+{
+    int n, len;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+
+    assert(targets);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (! ep->shifted) {
+                continue;
+            }
+            ep->shifted = 0;
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+            fprintf(out, "%s:%s %s%n", tp->host, tp->port, host, &len);
+            fprintf(out, "%*s", len < 42 ? 42 - len : 0, "");
+            fprintf(out, " shift   %4u.%03u -> %4u.%03u\n",
+                    (unsigned) ep->shift_from / 1000,
+                    (unsigned) ep->shift_from % 1000,
+                    (unsigned) ep->shift_to / 1000,
+                    (unsigned) ep->shift_to % 1000);
+        }
+    }
+}
+
+/*
+ * Report the latency regime shifts (-K). This function produces a more
+ * compact semicolon separated output format intended for consumption
+ * by other programs.
+ */
+
+static void
+report_shift_sk(target_t *targets, FILE *out)
+{
+    int n;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    time_t now;
+
+    assert(targets);
+
+    now = time(NULL);
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (! ep->shifted) {
+                continue;
+            }
+            ep->shifted = 0;
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+            fprintf(out, "SHIFT.0.4;%lu;%s;%s;%s;%u;%u\n",
+                    now, tp->host, tp->port, host,
+                    (unsigned) ep->shift_from, (unsigned) ep->shift_to);
+        }
+    }
+}
+
+/*
+ * Report the results to all loaded sinks. For each endpoint of a
+ * target, the sinks receive one record per selected measurement, the
+ * same information the other report functions format as text.
+ */
+
+static void
+report_sinks(target_t *targets)
+{
+    int n;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    struct happy_record rec;
+    int kinds[3], num_kinds = 0, k;
+
+    assert(targets);
+
+    if (dmode) kinds[num_kinds++] = HAPPY_RECORD_DNS;
+    if (cmode) kinds[num_kinds++] = HAPPY_RECORD_HAPPY;
+    if (pmode) kinds[num_kinds++] = HAPPY_RECORD_PUMP;
+
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        if (! target_probed(tp)) {
+            continue;
+        }
+
+        memset(&rec, 0, sizeof(rec));
+        rec.timestamp = time(NULL);
+        rec.host = tp->host;
+        rec.port = tp->port;
+
+        if (! tp->endpoints) {
+            for (k = 0; k < num_kinds; k++) {
+                rec.kind = kinds[k];
+                sink_record(&rec);
+            }
+        }
+
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+
+            rec.ok = ep->cnt > 0;
+            rec.addr = host;
+            rec.family = ep->family;
+            rec.nvalues = ep->idx;
+            rec.values = ep->values;
+            rec.sent = ep->send;
+            rec.rcvd = ep->rcvd;
+            rec.duration = pump_timeout;
+            rec.canonname = ep->canonname;
+            rec.reversename = ep->reversename;
+            for (k = 0; k < num_kinds; k++) {
+                rec.kind = kinds[k];
+                sink_record(&rec);
+            }
+        }
+    }
+}
+
+/*
+ * Report the history (-U) of the last window seconds for all targets
+ * or the given one, served from the finest rollup tier that covers the
+ * window. Latencies are in microseconds; quantiles are accurate to
+ * the width of the histogram buckets.
+ */
+
+static void
+history(target_t *targets, target_t *only, int64_t window, FILE *out)
+{
+    int n;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    rbin_t bin;
+    const char *tier;
+    time_t now;
+
+    now = time(NULL);
+
+    for (tp = only ? only : targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+            tier = rollup_query(ep->rollup, now, window, &bin);
+            fprintf(out, "HISTORY.0.4;%lu;%s;%s;%s;%s;%ld;%u;%u;"
+                    "%u;%u;%u;%u;%u;%u\n",
+                    now, tp->host, tp->port, host, tier, (long) window,
+                    bin.ok, bin.failed, bin.min,
+                    rbin_quantile(&bin, 0.5), rbin_quantile(&bin, 0.9),
+                    rbin_quantile(&bin, 0.99), bin.max,
+                    bin.ok ? (unsigned) (bin.sum / bin.ok) : 0);
+        }
+        if (only) {
+            break;
+        }
+    }
+}
+
+/*
+ * Write the current results in the format of -m together with the
+ * engine counters and the rounds of the current run done. Used for
+ * SIGUSR1 and the dump-stats command of the control socket.
+ */
+
+static void
+stats(target_t *targets, FILE *out)
+{
+    if (targets) {
+        if (dmode) {
+            report_dns_sk(targets, out);
+        }
+        if (cmode) {
+            report_sk(targets, out);
+        }
+        if (pmode) {
+            report_pump_sk(targets, out);
+        }
+    }
+    if (targets && umode) {
+        history(targets, NULL, 3600, out);
+    }
+    fprintf(out, "ENGINE.0.4;%lu;%lu;%lu;%lu;%lu;%d;%d\n",
+            (unsigned long) time(NULL), engine.rounds,
+            engine.connects, engine.selects, engine.scrapes,
+            rounds_done, nqueries);
+}
+
+static void
+dump(target_t *targets)
+{
+    dumping = 0;
+    stats(targets, stderr);
+    fflush(stderr);
+}
+
+/*
+ * Append a buffer of report lines to a file opened with O_APPEND. The
+ * lines are grouped into batches of at most append_batch bytes and
+ * each batch is written with a single write(), so that records of
+ * concurrent happy instances appending to the same file never
+ * interleave. A batch never splits a line; a line longer than
+ * append_batch is written on its own. A batch that is only written in
+ * part (e.g. on a full disk) is an error, since writing the rest
+ * separately could interleave with other instances.
+ */
+
+static void
+append_write(int fd, const char *buf, size_t len)
+{
+    size_t n, last;
+    ssize_t rc;
+
+    while (len) {
+        for (n = 0, last = 0; n < len && n < append_batch; n++) {
+            if (buf[n] == '\n') {
+                last = n + 1;
+            }
+        }
+        if (! last) {
+            const char *nl = memchr(buf, '\n', len);
+            last = nl ? (size_t) (nl - buf) + 1 : len;
+        }
+        rc = SYS(write(fd, buf, last));
+        if (rc == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: write: %s\n", progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if ((size_t) rc != last) {
+            fprintf(stderr, "%s: write: short write of %zd of %zu bytes\n",
+                    progname, rc, last);
+            exit(EXIT_FAILURE);
+        }
+        buf += rc;
+        len -= rc;
+    }
+}
+
+/*
+ * Produce all selected reports. Normally the reports are written to
+ * standard output, which is locked while we write. If an append file
+ * has been given (-A), the reports are formatted in memory and then
+ * appended to the file without taking a lock.
+ */
+
+static void
+output(target_t *targets)
+{
+    FILE *out = stdout;
+    char *buf = NULL;
+    size_t len = 0;
+    int64_t start;
+
+    /* a worker (-J) leaves the reports to the coordinator, it only
+     * returns the results (see shard_work()) */
+    if (shard_fd != -1) {
+        return;
+    }
+
+    if (append_fd != -1) {
+        out = open_memstream(&buf, &len);
+        if (! out) {
+            fprintf(stderr, "%s: open_memstream: %s\n",
+                    progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        lock(stdout);
+    }
+
+    /* with health scoring or change-point detection, only the
+     * alerts and shifts are reported */
+    if (emode) {
+        start = now_us();
+        prof_enter(PH_REPORT);
+        if (skmode) {
+            report_health_sk(targets, out);
+        } else {
+            report_health(targets, out);
+        }
+        prof_leave();
+        post_span("report health", NULL, NULL, NULL, start, 0, 0);
+    }
+    if (kmode) {
+        start = now_us();
+        prof_enter(PH_REPORT);
+        if (skmode) {
+            report_shift_sk(targets, out);
+        } else {
+            report_shift(targets, out);
+        }
+        prof_leave();
+        post_span("report shift", NULL, NULL, NULL, start, 0, 0);
+    }
+
+    if (dmode && ! emode && ! kmode) {
+        start = now_us();
+        prof_enter(PH_REPORT_DNS);
+        if (skmode) {
+            report_dns_sk(targets, out);
+        } else {
+            report_dns(targets, out);
+        }
+        prof_leave();
+        post_span("report dns", NULL, NULL, NULL, start, 0, 0);
+    }
+    if (cmode && ! emode && ! kmode) {
+        start = now_us();
+        prof_enter(PH_REPORT);
+        if (skmode) {
+            report_sk(targets, out);
+        } else {
+            if (dmode) {
+                fprintf(out, "\n");
+            }
+            report(targets, out);
+        }
+        prof_leave();
+        post_span("report", NULL, NULL, NULL, start, 0, 0);
+    }
+    if (pmode && ! emode && ! kmode) {
+        start = now_us();
+        prof_enter(PH_REPORT_PUMP);
+        if (skmode) {
+            report_pump_sk(targets, out);
+        } else {
+            if (cmode) {
+                fprintf(out, "\n");
+            }
+            report_pump(targets, out);
+        }
+        prof_leave();
+        post_span("report pump", NULL, NULL, NULL, start, 0, 0);
+    }
+
+    if (stopping && rounds_done < nqueries) {
+        if (skmode) {
+            fprintf(out, "PARTIAL.0.4;%lu;%d;%d\n",
+                    (unsigned long) time(NULL), rounds_done, nqueries);
+        } else {
+            fprintf(out, "\n(interrupted after %d of %d rounds)\n",
+                    rounds_done, nqueries);
+        }
+    }
+
+    if (append_fd != -1) {
+        (void) fclose(out);
+        append_write(append_fd, buf, len);
+        free(buf);
+    } else {
+        fflush(stdout);
+        unlock(stdout);
+    }
+
+    if (num_sinks) {
+        start = now_us();
+        prof_enter(PH_REPORT_SINKS);
+        report_sinks(targets);
+        prof_leave();
+        post_span("report sinks", NULL, NULL, NULL, start, 0, 0);
+    }
+}
+
+/*
+ * Release a single target. The measurement arrays of its endpoints
+ * go back to the pool.
+ */
+
+static void
+release(target_t *tp)
+{
+    endpoint_t *ep;
+
+    for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+	if (ep->socket) {
+	    (void) SYS(close(ep->socket));
 	}
-	
-	/* create a string representation of CNAME chains */
-	canonname = NULL;
-	for (int i = 0; i < dstset_num; i++){
-	    char* dangler = canonname;
-	    char* dst = dstset[i];
-	    if (i == 0) {
-		asprintf(&canonname, "%s", dst);
-		free(dst);
-		continue;
-	    }
-	    if (i == 1) {
-		asprintf(&canonname, "%s >", dangler);
-		free(dangler); dangler = canonname;
-	    }
-	    if ((i + 1) == dstset_num) {
-		asprintf(&canonname, "%s %s",dangler,dst);
-	    } else {
-		asprintf(&canonname, "%s %s >", dangler, dst);
-	    }
-	    if (dst != NULL) { free(dst); dst = NULL; }
-	    if (dangler !=NULL) { free(dangler); dangler = NULL; }
+	if (ep->canonname) {
+	    (void) free(ep->canonname);
 	}
-	free(dstset); dstset = NULL;
+	if (ep->reversename) {
+	    (void) free(ep->reversename);
+	}
+	if (ep->rollup) {
+	    (void) free(ep->rollup);
+	}
+	pool_put(ep->values, nqueries * sizeof(*ep->values));
+    }
+    if (tp->endpoints) (void) free(tp->endpoints);
+    if (tp->stats) (void) free(tp->stats);
+    if (tp->host) (void) free(tp->host);
+    if (tp->port) (void) free(tp->port);
+    (void) free(tp);
+}
+
+/*
+ * Cleanup targets and release all target data structures.
+ */
+
+static void
+cleanup(target_t *targets)
+{
+    target_t *tp, *np;
+
+    assert(targets);
+
+    for (tp = targets; target_valid(tp); tp = np) {
+	np = tp->next;
+	release(tp);
+    }
+    pool_free();
+}
+
+/*
+ * Checkpoints (-k) keep the state of a long measurement across crashes
+ * and restarts: the targets with their intervals, resolved endpoints
+ * and names, the measurements of the current run, the cumulative
+ * statistics and the number of rounds of the current run already
+ * done. A checkpoint is written after a round or after the reports of
+ * a run when the previous one is at least CKPT_PERIOD seconds old,
+ * after the reports of a single run and when continuous mode is
+ * stopped after all rounds of a run. A run stopped mid-round keeps the
+ * last checkpoint, which may lag behind by up to CKPT_PERIOD seconds. It goes to a temporary file first
+ * that is then renamed, so that the file always holds a complete
+ * checkpoint. A checkpoint that cannot be written is skipped with a
+ * warning, the measurement goes on. The endpoint structures are stored
+ * as they are, hence checkpoints can only be resumed (-R) by the same
+ * build of happy on the same host.
+ */
+
+#define CKPT_MAGIC		"HAPPYCK"
+#define CKPT_VERSION		3
+#define CKPT_ORDER		0x01020304
+#define CKPT_PERIOD		60	/* seconds between checkpoints */
+
+typedef struct ckpt_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint32_t endpoint_size;		/* sizeof(endpoint_t) */
+    uint32_t nqueries;
+    uint32_t round;			/* rounds of the current run done */
+    uint32_t num_targets;
+    uint64_t rounds;			/* engine counters */
+    uint64_t connects;
+    uint64_t selects;
+    uint64_t scrapes;
+} ckpt_header_t;
+
+typedef struct ckpt_target {
+    uint32_t hostlen;
+    uint32_t portlen;
+    uint32_t num_endpoints;
+    uint32_t stats;			/* 1 if a tstats_t follows */
+    uint32_t every;			/* interval of the target (ms) */
+    uint32_t probed;			/* probed in this run */
+} ckpt_target_t;
+
+typedef struct ckpt_endpoint {
+    uint32_t canonlen;			/* 0 if there is no name */
+    uint32_t revlen;
+    uint32_t rollup;			/* 1 if a rollup_t follows */
+    uint32_t pad;
+} ckpt_endpoint_t;
+
+static int
+ckpt_write(FILE *f, const void *buf, size_t len)
+{
+    return (len && fwrite(buf, 1, len, f) != len) ? -1 : 0;
+}
+
+static int
+ckpt_read(FILE *f, void *buf, size_t len)
+{
+    return (len && fread(buf, 1, len, f) != len) ? -1 : 0;
+}
+
+/*
+ * Set up the header of a checkpoint (or of the results of a shard)
+ * holding num_targets targets.
+ */
+
+static void
+ckpt_header(ckpt_header_t *hdr, uint32_t num_targets)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, CKPT_MAGIC, sizeof(CKPT_MAGIC));
+    hdr->version = CKPT_VERSION;
+    hdr->order = CKPT_ORDER;
+    hdr->endpoint_size = sizeof(endpoint_t);
+    hdr->nqueries = nqueries;
+    hdr->round = rounds_done;
+    hdr->num_targets = num_targets;
+    hdr->rounds = engine.rounds;
+    hdr->connects = engine.connects;
+    hdr->selects = engine.selects;
+    hdr->scrapes = engine.scrapes;
+}
+
+static int
+ckpt_compatible(const ckpt_header_t *hdr)
+{
+    return (memcmp(hdr->magic, CKPT_MAGIC, sizeof(CKPT_MAGIC)) == 0
+            && hdr->version == CKPT_VERSION && hdr->order == CKPT_ORDER
+            && hdr->endpoint_size == sizeof(endpoint_t));
+}
+
+/*
+ * Write the record of a target and its endpoints. Returns -1 if the
+ * record could not be written.
+ */
+
+static int
+ckpt_save(FILE *f, target_t *tp)
+{
+    ckpt_target_t ct;
+    ckpt_endpoint_t ce;
+    endpoint_t *ep;
+    int rc;
+
+    ct.hostlen = strlen(tp->host);
+    ct.portlen = strlen(tp->port);
+    ct.num_endpoints = tp->num_endpoints;
+    ct.stats = tp->stats != NULL;
+    ct.every = tp->every;
+    ct.probed = target_probed(tp);
+    rc = ckpt_write(f, &ct, sizeof(ct))
+        || ckpt_write(f, tp->host, ct.hostlen)
+        || ckpt_write(f, tp->port, ct.portlen)
+        || (tp->stats && ckpt_write(f, tp->stats, sizeof(tstats_t)));
+    for (ep = tp->endpoints; endpoint_valid(ep) && ! rc; ep++) {
+        ce.canonlen = ep->canonname ? strlen(ep->canonname) : 0;
+        ce.revlen = ep->reversename ? strlen(ep->reversename) : 0;
+        ce.rollup = ep->rollup != NULL;
+        ce.pad = 0;
+        rc = ckpt_write(f, &ce, sizeof(ce))
+            || ckpt_write(f, ep, sizeof(*ep))
+            || ckpt_write(f, ep->canonname, ce.canonlen)
+            || ckpt_write(f, ep->reversename, ce.revlen)
+            || ckpt_write(f, ep->values, nqueries * sizeof(*ep->values))
+            || (ep->rollup && ckpt_write(f, ep->rollup, sizeof(rollup_t)));
     }
+    return rc ? -1 : 0;
+}
+
+/*
+ * Read the record of a target into a new target; it and its endpoints
+ * get new ids. Returns NULL if the record is truncated or malformed.
+ */
 
-    tp = xcalloc(1, sizeof(target_t));
-    tp->host = strdup(host);
-    tp->port = strdup(port);
+static target_t*
+ckpt_load(FILE *f)
+{
+    ckpt_target_t ct;
+    ckpt_endpoint_t ce;
+    target_t *tp;
+    endpoint_t *ep;
+    uint32_t j;
 
-    n = getaddrinfo(host, port, &hints, &ai_list);
-    if (n != 0) {
-        fprintf(stderr, "%s: getaddrinfo: %s (skipping %s port %s)\n",
-                progname, gai_strerror(n), host, port);
-	return tp;
+    if (ckpt_read(f, &ct, sizeof(ct))
+        || ct.hostlen > 1024 || ct.portlen > 1024
+        || ct.num_endpoints > 65536 || ct.every > INT_MAX) {
+        return NULL;
+    }
+    tp = xcalloc(1, sizeof(target_t));
+    tp->id = target_id++;
+    tp->every = ct.every;
+    tp->probed = ct.probed != 0;
+    tp->host = xcalloc(1, ct.hostlen + 1);
+    tp->port = xcalloc(1, ct.portlen + 1);
+    if (ct.num_endpoints) {
+        tp->num_endpoints = ct.num_endpoints;
+        tp->endpoints = xcalloc(1 + ct.num_endpoints, sizeof(endpoint_t));
+    }
+    if (ckpt_read(f, tp->host, ct.hostlen)
+        || ckpt_read(f, tp->port, ct.portlen)) {
+        goto fail;
+    }
+    if (ct.stats) {
+        tp->stats = xcalloc(1, sizeof(tstats_t));
+        if (ckpt_read(f, tp->stats, sizeof(tstats_t))) {
+            goto fail;
+        }
+    }
+    for (j = 0, ep = tp->endpoints; j < ct.num_endpoints; j++, ep++) {
+        if (ckpt_read(f, &ce, sizeof(ce)) || ckpt_read(f, ep, sizeof(*ep))) {
+            memset(ep, 0, sizeof(*ep));
+            goto fail;
+        }
+        /* the pointers are those of the process that wrote it */
+        ep->id = endpoint_id++;
+        ep->socket = 0;
+        ep->state = EP_STATE_NEW;
+        ep->live = NULL;
+        ep->rollup = NULL;
+        ep->values = NULL;
+        ep->canonname = ep->reversename = NULL;
+        if (ce.canonlen > NI_MAXHOST * 8 || ce.revlen > NI_MAXHOST
+            || ep->idx > nqueries || ! endpoint_valid(ep)
+            || ep->addrlen > sizeof(ep->addr)) {
+            goto fail;
+        }
+        if (ce.canonlen) {
+            ep->canonname = xcalloc(1, ce.canonlen + 1);
+        }
+        if (ce.revlen) {
+            ep->reversename = xcalloc(1, ce.revlen + 1);
+        }
+        ep->values = pool_alloc(nqueries * sizeof(*ep->values));
+        if (ce.rollup) {
+            ep->rollup = xcalloc(1, sizeof(rollup_t));
+        }
+        if (ckpt_read(f, ep->canonname, ce.canonlen)
+            || ckpt_read(f, ep->reversename, ce.revlen)
+            || ckpt_read(f, ep->values, nqueries * sizeof(*ep->values))
+            || (ep->rollup && ckpt_read(f, ep->rollup, sizeof(rollup_t)))) {
+            goto fail;
+        }
     }
+    return tp;
 
-    for (ai = ai_list, tp->num_endpoints = 0;
-         ai; ai = ai->ai_next, tp->num_endpoints++) ;
-    tp->endpoints = xcalloc(1 + tp->num_endpoints, sizeof(endpoint_t));
+fail:
+    release(tp);
+    return NULL;
+}
 
-    for (ai = ai_list, ep = tp->endpoints; ai; ai = ai->ai_next, ep++) {
-	ep->family = ai->ai_family;
-	ep->socktype = ai->ai_socktype;
-	ep->protocol = ai->ai_protocol;
-	memcpy(&ep->addr, ai->ai_addr, ai->ai_addrlen);
-	ep->addrlen = ai->ai_addrlen;
-	ep->values = xcalloc(nqueries, sizeof(unsigned int));
-	if (dmode) {
-	    char revname[NI_MAXHOST];
-	    int n;
-	    revname[0] = 0;
-	    if (canonname != NULL) {
-		ep->canonname = strdup(canonname);
-	    } else {
-		ep->canonname = strdup(host);
-	    }
+/*
+ * Write a checkpoint if the last one is older than CKPT_PERIOD or if
+ * forced to.
+ */
 
-	    n = getnameinfo(ai->ai_addr, ai->ai_addrlen,
-			    revname, sizeof(revname), NULL, 0,
-			    NI_NAMEREQD);
-	    if (n && n != EAI_NONAME) {
-		fprintf(stderr, "%s: getnameinfo: %s\n",
-			progname, gai_strerror(n));
-	    } else {
-		if (strlen(revname)) {
-		    ep->reversename = strdup(revname);
-		}
-	    }
-	}
+static void
+checkpoint(target_t *targets, int force)
+{
+    static int64_t last = 0;
+    FILE *f;
+    char *tmp;
+    ckpt_header_t hdr;
+    target_t *tp;
+    uint32_t n = 0;
+    int64_t now;
+    int rc;
+
+    if (! ckpt_file) {
+        return;
     }
+    now = now_us();
+    if (! force && last && now - last < CKPT_PERIOD * 1000000LL) {
+        return;
+    }
+    last = now;
 
-    freeaddrinfo(ai_list);
-    free(canonname); canonname = NULL;
+    for (tp = targets; target_valid(tp); tp = tp->next) {
+        n++;
+    }
+    ckpt_header(&hdr, n);
+
+    xasprintf(&tmp, "%s.tmp", ckpt_file);
+    f = fopen(tmp, "w");
+    if (! f) {
+        fprintf(stderr, "%s: checkpoint %s: %s\n",
+                progname, tmp, strerror(errno));
+        free(tmp);
+        return;
+    }
+    rc = ckpt_write(f, &hdr, sizeof(hdr));
+    for (tp = targets; target_valid(tp) && ! rc; tp = tp->next) {
+        rc = ckpt_save(f, tp);
+    }
 
-    return tp;
+    if (rc || fflush(f) == EOF || fsync(fileno(f)) == -1) {
+        fprintf(stderr, "%s: checkpoint %s: %s\n",
+                progname, tmp, strerror(errno));
+        (void) fclose(f);
+        (void) unlink(tmp);
+    } else if (fclose(f) == EOF || rename(tmp, ckpt_file) == -1) {
+        fprintf(stderr, "%s: checkpoint %s: %s\n",
+                progname, ckpt_file, strerror(errno));
+        (void) unlink(tmp);
+    }
+    free(tmp);
 }
 
 /*
- * Generate the file descriptor set for all sockets with a pending
- * asynchronous connect(). If the struct timeval argument is a valid
- * pointer, leave the smallest timestamp of a socket with a pending
- * asynchronous connect in the struct timeval.
+ * Restore the state saved in the checkpoint file, if there is one.
+ * Targets in the checkpoint replace targets of the same name already
+ * read from a file (-f); new ids are assigned to all of them.
+ * Returns 1 if a checkpoint has been restored.
  */
 
 static int
-generate_fdset(target_t *targets, fd_set *fdset, struct timeval *to)
+resume(void)
 {
-    int max;
-    target_t *tp;
-    endpoint_t *ep;
+    FILE *f;
+    ckpt_header_t hdr;
+    target_t *tp, *old;
+    uint32_t i;
+
+    f = fopen(ckpt_file, "r");
+    if (! f) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "%s: checkpoint %s: %s\n",
+                progname, ckpt_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    if (to) {
-        timerclear(to);
+    if (ckpt_read(f, &hdr, sizeof(hdr)) || ! ckpt_compatible(&hdr)) {
+        fprintf(stderr, "%s: %s: not a compatible checkpoint\n",
+                progname, ckpt_file);
+        exit(EXIT_FAILURE);
     }
-    FD_ZERO(fdset);
-    for (tp = targets, max = -1; target_valid(tp); tp = tp->next) {
-        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-            if (ep->state == EP_STATE_CONNECTING) {
-                FD_SET(ep->socket, fdset);
-                if (ep->socket > max) {
-                    max = ep->socket;
-                }
-                if (to) {
-                    if (! timerisset(to) || timercmp(&ep->tvs, to, <)) {
-                        *to = ep->tvs;
-                    }
-                }
+    if (hdr.nqueries != nqueries || hdr.round > hdr.nqueries) {
+        fprintf(stderr, "%s: %s: checkpoint of a run with %u queries\n",
+                progname, ckpt_file, hdr.nqueries);
+        exit(EXIT_FAILURE);
+    }
+    rounds_done = hdr.round;
+    engine.rounds = hdr.rounds;
+    engine.connects = hdr.connects;
+    engine.selects = hdr.selects;
+    engine.scrapes = hdr.scrapes;
+
+    for (i = 0; i < hdr.num_targets; i++) {
+        tp = ckpt_load(f);
+        if (! tp) {
+            fprintf(stderr, "%s: %s: malformed checkpoint\n",
+                    progname, ckpt_file);
+            exit(EXIT_FAILURE);
+        }
+        if (tp->every) {
+            classes = 1;
+        }
+
+        old = lookup(tp->host, tp->port);
+        if (old) {
+            /* an interval given in the file (-f) takes precedence */
+            if (old->every) {
+                tp->every = old->every;
             }
+            detach(old);
+            release(old);
         }
+        append(tp);
     }
 
-    return max;
+    (void) fclose(f);
+    return 1;
 }
 
 /*
- * Go through all endpoints and check which ones have timed out, for
- * which ones the asynchronous connect() has finished and update the
- * stats accordingly.
+ * Read a list of targets from a file or standard input if the
+ * filename is '-'.
  */
 
 static void
-update(target_t *targets, fd_set *fdset)
+import(const char *filename, char **ports)
 {
-    struct timeval tv, td;
-    int soerror;
-    socklen_t soerrorlen = sizeof(soerror);
+    FILE *in;
+    char line[512], *host, *p, *endptr;
+    long every;
     target_t *tp;
+    int j;
+
+    if (! filename || strcmp(filename, "-") == 0) {
+        clearerr(stdin);
+        in = stdin;
+    } else {
+        in = fopen(filename, "r");
+        if (! in) {
+            fprintf(stderr, "%s: fopen: %s\n",
+                    progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        host = trim(line);
+        if (! *host) {
+            continue;
+        }
+        /* an optional second column is the interval of the target */
+        every = 0;
+        p = host + strcspn(host, " \t");
+        if (*p) {
+            *p++ = 0;
+            p = trim(p);
+            every = strtol(p, &endptr, 10);
+            if (every <= 0 || every > INT_MAX || *endptr) {
+                fprintf(stderr, "%s: invalid interval '%s' for target %s\n",
+                        progname, p, host);
+                exit(EXIT_FAILURE);
+            }
+            classes = 1;
+        }
+        for (j = 0; ports[j]; j++) {
+            tp = expand(host, ports[j]);
+            tp->every = every;
+            append(tp);
+        }
+    }
+
+    if (ferror(in)) {
+        fprintf(stderr, "%s: ferror: %s\n",
+                progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+}
+
+/*
+ * Read a raw event log written with -w and rebuild the targets and
+ * their statistics from it, exactly as if the events had just been
+ * observed. The parameters of the recorded run replace the defaults
+ * so that the regular report functions produce the same output.
+ */
+
+static void
+replay(const char *filename)
+{
+    FILE *in;
+    evlog_header_t hdr;
+    evlog_event_t ev;
+    char *payload = NULL;
+    target_t *tp = NULL;
     endpoint_t *ep;
-    unsigned int us;
+    struct timeval tv;
+    struct { target_t *tp; int idx; } *map = NULL;
+    size_t map_len = 0;
 
-    assert(targets && fdset);
+    in = fopen(filename, "r");
+    if (! in) {
+        fprintf(stderr, "%s: fopen: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    (void) gettimeofday(&tv, NULL);
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1
+        || memcmp(hdr.magic, EVLOG_MAGIC, sizeof(EVLOG_MAGIC)) != 0
+        || hdr.order != EVLOG_ORDER || hdr.version != EVLOG_VERSION) {
+        fprintf(stderr, "%s: %s: not a compatible event log\n",
+                progname, filename);
+        exit(EXIT_FAILURE);
+    }
+    nqueries = hdr.nqueries;
+    timeout = hdr.timeout;
+    delay = hdr.delay;
+    pump_timeout = hdr.pump_timeout;
+
+    while (fread(&ev, sizeof(ev), 1, in) == 1) {
+        if (ev.len) {
+            payload = xrealloc(payload, ev.len + 1);
+            if (fread(payload, ev.len, 1, in) != 1) {
+                break;
+            }
+            payload[ev.len] = 0;
+        }
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
-        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-            /* calculate time since we started the connect */
-            timersub(&tv, &ep->tvs, &td);
-            us = td.tv_sec*1000000 + td.tv_usec;
-            if (ep->state == EP_STATE_CONNECTING && us >= timeout * 1000) {
-                ep->values[ep->idx] = -us;
-                ep->idx++;
-                ep->cnt++;
-                (void) close(ep->socket);
-                ep->socket = 0;
-                ep->state = EP_STATE_TIMEDOUT;
-                continue;
+        if (((ev.type == EV_TARGET || ev.type == EV_ENDPOINT) && ! ev.len)
+            || (ev.type == EV_TARGET && strlen(payload) >= ev.len)) {
+            fprintf(stderr, "%s: %s: malformed definition record\n",
+                    progname, filename);
+            exit(EXIT_FAILURE);
+        }
+
+        if (ev.type == EV_TARGET) {
+            tp = xcalloc(1, sizeof(target_t));
+            tp->id = ev.id;
+            tp->host = xstrdup(payload);
+            tp->port = xstrdup(payload + strlen(payload) + 1);
+            append(tp);
+            continue;
+        }
+
+        if (ev.type == EV_ENDPOINT) {
+            char *canon, *rev;
+
+            if (! tp || tp->id != ev.value || ev.err <= 0
+                || ev.err >= ev.len || ev.err > (int) sizeof(ep->addr)) {
+                fprintf(stderr, "%s: %s: malformed definition record\n",
+                        progname, filename);
+                exit(EXIT_FAILURE);
             }
-            if (ep->state == EP_STATE_CONNECTING
-                && FD_ISSET(ep->socket, fdset)) {
-                if (-1 == getsockopt(ep->socket, SOL_SOCKET, SO_ERROR,
-                                     &soerror, &soerrorlen)) {
-                    fprintf(stderr, "%s: getsockopt: %s\n",
-                            progname, strerror(errno));
-                    exit(EXIT_FAILURE);
-                }
-                if (! soerror) {
-                    ep->values[ep->idx] = us;
-                    ep->sum += us;
-                    ep->tot++;
-                    ep->cnt++;
-                    ep->idx++;
-                } else {
-                    ep->values[ep->idx] = -us;
-                    ep->cnt++;
-                    ep->idx++;
-                }
-                if (! pmode) {
-                    (void) close(ep->socket);
-                    ep->socket = 0;
-                }
-                ep->state = EP_STATE_CONNECTED;
+            canon = payload + ev.err;
+            rev = canon + strlen(canon);
+            if (rev < payload + ev.len) {
+                rev++;
+            }
+            tp->endpoints = xrealloc(tp->endpoints,
+                                     (tp->num_endpoints + 2) * sizeof(*ep));
+            ep = tp->endpoints + tp->num_endpoints;
+            memset(ep, 0, 2 * sizeof(*ep));
+            ep->id = ev.id;
+            ep->family = ev.family;
+            ep->socktype = SOCK_STREAM;
+            memcpy(&ep->addr, payload, ev.err);
+            ep->addrlen = ev.err;
+            ep->values = pool_alloc(nqueries * sizeof(*ep->values));
+            if (*canon) {
+                ep->canonname = xstrdup(canon);
+            } else if (dmode) {
+                ep->canonname = xstrdup(tp->host);
+            }
+            if (*rev) {
+                ep->reversename = xstrdup(rev);
+            }
+            if (ev.id >= map_len) {
+                size_t n = map_len ? map_len : 64;
+                while (n <= ev.id) n *= 2;
+                map = xrealloc(map, n * sizeof(*map));
+                memset(map + map_len, 0, (n - map_len) * sizeof(*map));
+                map_len = n;
             }
+            map[ev.id].tp = tp;
+            map[ev.id].idx = tp->num_endpoints++;
+            continue;
         }
+
+        if (ev.id >= map_len || ! map[ev.id].tp) {
+            continue;
+        }
+        ep = map[ev.id].tp->endpoints + map[ev.id].idx;
+        tv.tv_sec = ev.ts / 1000000;
+        tv.tv_usec = ev.ts % 1000000;
+
+        switch (ev.type) {
+        case EV_CONNECT:
+            ep->state = EP_STATE_CONNECTING;
+            break;
+        case EV_DONE:
+            if (ep->idx < nqueries) {
+                account(ep, ev.value, ! ev.err);
+            }
+            post_event(EV_DONE, map[ev.id].tp, ep, &tv, ev.value, ev.err);
+            ep->state = EP_STATE_CONNECTED;
+            break;
+        case EV_TIMEOUT:
+            if (ep->idx < nqueries) {
+                account(ep, ev.value, 0);
+            }
+            post_event(EV_TIMEOUT, map[ev.id].tp, ep, &tv, ev.value, 0);
+            ep->state = EP_STATE_TIMEDOUT;
+            break;
+        case EV_FAIL:
+            ep->state = EP_STATE_FAILED;
+            break;
+        case EV_SENT:
+            ep->send += ev.value;
+            break;
+        case EV_RCVD:
+            ep->rcvd += ev.value;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (ferror(in)) {
+        fprintf(stderr, "%s: ferror: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
     }
+
+    fclose(in);
+    free(payload);
+    free(map);
 }
 
 /*
- * For all endpoints, create a socket and start a non-blocking
- * connect(). In order to avoid creating bursts of TCP SYN packets,
- * we take a short nap before each connect() call. Note that
- * asynchronous connect()s might actually succeed during the
- * short nap.
+ * Pump connections with HTTP GET requests and measure the datarate
+ * (throughput) of the stream of responses.
  */
 
 static void
-prepare(target_t *targets)
+pump(target_t *targets)
 {
-    int rc, flags;
-    fd_set fdset;
-    target_t *tp;
+    static char const template[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: %s\r\n"
+    "User-Agent: pump/0.1\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: Keep-Alive\r\n"
+    "\r\n";
+
+    static char msg[sizeof(template) + NI_MAXHOST];
+    size_t msglen;
+    target_t *tp, *np;
     endpoint_t *ep;
-    struct timeval dts, dtn, dtd, dd;
+    struct timeval ts, tn, td;
+    fd_set rfds, wfds;
+    char buffer[8192];
+    unsigned int us;
+    int rc;
 
     assert(targets);
 
-    dd.tv_sec = delay / 1000;
-    dd.tv_usec = (delay % 1000) * 1000;
+    /* ignore SIGPIPE, handle locally the returned EPIPE error */
+    signal(SIGPIPE, SIG_IGN);
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+    for (tp = targets; target_valid(tp); tp = np) {
+        np = tp->next;
         for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (ep->state != EP_STATE_CONNECTED) {
+                continue;
+            }
+            msglen = snprintf(msg, sizeof(msg), template, tp->host);
+            if (msglen >= sizeof(msg)) {
+                fprintf(stderr, "%s: host name too long for %s\n",
+                        progname, tp->host);
+                continue;
+            }
 
-            if (delay) {
-                int max;
-                struct timeval to;
-
-                (void) gettimeofday(&dts, NULL);
-
-                while (1) {
-                    max = generate_fdset(targets, &fdset, NULL);
-
-                    (void) gettimeofday(&dtn, NULL);
-                    timersub(&dtn, &dts, &dtd);
-                    if (timercmp(&dd, &dtd, <)) {
-                        break;
+            (void) gettimeofday(&ts, NULL);
+            us = 0;
+            while (us < pump_timeout * 1000 && ! stopping) {
+                FD_ZERO(&rfds);
+                FD_SET(ep->socket, &rfds);
+                FD_ZERO(&wfds);
+                FD_SET(ep->socket, &wfds);
+                ssize_t sent = 0;
+                ssize_t received = 0;
+                rc = SYS(select(1 + ep->socket, &rfds, &wfds, NULL, NULL));
+                if (rc == -1) {
+                    if (errno == EINTR) {
+                        continue;
                     }
+                    diag_die(HAPPY_DIAG_SELECT, ep);
+                }
 
-                    timeradd(&dts, &dd, &to);
-                    timersub(&to, &dtn, &to);
-                    rc = select(1 + max, NULL, &fdset, NULL, &to);
-                    if (rc == -1) {
-                        fprintf(stderr, "%s: select failed: %s\n",
-                                progname, strerror(errno));
-                        exit(EXIT_FAILURE);
+                if (FD_ISSET(ep->socket, &rfds)) {
+                    received = SYS(recv(ep->socket, buffer,
+                                        sizeof(buffer), 0));
+                    if(received<0) {
+                        diag_record(HAPPY_DIAG_RECV, ep, 0);
+                        if (errno == EPIPE) break;
+                    } else {
+                        PROBE4(pump__recv, ep->id, ep->family, received, us);
+                        ep->rcvd += received;
+                        post_event(EV_RCVD, tp, ep, NULL, received, 0);
                     }
-                    update(targets, &fdset);
                 }
-            }
-
-            ep->socket = socket(ep->family, ep->socktype, ep->protocol);
-            if (ep->socket < 0) {
-                switch (errno) {
-                    case EAFNOSUPPORT:
-                    case EPROTONOSUPPORT:
-                        continue;
 
-                    default:
-                        fprintf(stderr, "%s: socket: %s (skipping %s port %s)\n",
-                                progname, strerror(errno), tp->host, tp->port);
-                        ep->socket = 0;
-                        ep->state = EP_STATE_FAILED;
-                        continue;
+                if (FD_ISSET(ep->socket, &wfds)) {
+                    sent = SYS(send(ep->socket, msg, msglen, 0));
+                    if(sent<0) {
+                        diag_record(HAPPY_DIAG_SEND, ep, 0);
+                        if (errno == EPIPE) break;
+                    } else {
+                        PROBE4(pump__send, ep->id, ep->family, sent, us);
+                        ep->send += sent;
+                        post_event(EV_SENT, tp, ep, NULL, sent, 0);
+                    }
                 }
+
+                (void) gettimeofday(&tn, NULL);
+                timersub(&tn, &ts, &td);
+                us = td.tv_sec*1000000 + td.tv_usec;
             }
 
-            flags = fcntl(ep->socket, F_GETFL, 0);
-            if (fcntl(ep->socket, F_SETFL, flags | O_NONBLOCK) == -1) {
-                fprintf(stderr, "%s: fcntl: %s (skipping %s port %s)\n",
-                        progname, strerror(errno), tp->host, tp->port);
-                (void) close(ep->socket);
+            if (ep->socket) {
+                (void) SYS(close(ep->socket));
                 ep->socket = 0;
-                ep->state = EP_STATE_FAILED;
-                continue;
             }
-
-            if (connect(ep->socket,
-                        (struct sockaddr *) &ep->addr,
-                        ep->addrlen) == -1) {
-                if (errno != EINPROGRESS) {
-                    fprintf(stderr, "%s: connect: %s (skipping %s port %s)\n",
-                            progname, strerror(errno), tp->host, tp->port);
-                    (void) close(ep->socket);
-                    ep->socket = 0;
-                    ep->state = EP_STATE_FAILED;
-                    continue;
-                }
+            post_span("pump", "{\"sent\":%d,\"rcvd\":%d}", tp, ep,
+                      tv2us(&ts), ep->send, ep->rcvd);
+            if (dumping) {
+                dump(targets);
             }
-
-            ep->state = EP_STATE_CONNECTING;
-            (void) gettimeofday(&ep->tvs, NULL);
         }
     }
 }
 
 
+size_t write_data(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+    /*Since we are not interested in the response just do nothing here.*/
+    return size * nmemb;
+}
+
 /*
- * Wait in a select() loop for any pending connect() requests to
- * complete. If the connect() was successful, collect basic timing
- * statistics.
+ * Measure DNS, TCP and TLS setup times of a HTTPS request with libcurl
+ * as a point of reference for the probes and print them to out.
  */
 
 static void
-collect(target_t *targets)
+curl_probe(FILE *out)
 {
-    int rc, max;
-    fd_set fdset;
-    struct timeval to, ts, tn;
-
-    assert(targets);
-
-    while (1) {
-
-        if (timeout) {
-            to.tv_sec = timeout / 1000;
-            to.tv_usec = (timeout % 1000) * 1000;
-        }
-
-        max = generate_fdset(targets, &fdset, timeout ? &ts : NULL);
-        if (max == -1) {
-            break;
-        }
-
-        if (timeout) {
-            (void) gettimeofday(&tn, NULL);
-            timeradd(&ts, &to, &to);
-            timersub(&to, &tn, &to);
+    curl_global_init(CURL_GLOBAL_SSL);
+    CURL *curl;
+    curl = curl_easy_init();
+    if(curl)
+    {
+        CURLcode res;
+        curl_easy_setopt(curl, CURLOPT_URL, "https://www.google.com");
+        curl_easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2);  /*Set the TLS version CURL_SSLVERSION_TLSv1_3 is the newest*/
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data); 
+        res = curl_easy_perform(curl);
+        if(res == CURLE_OK)
+        {
+            double connect_dns, connect_tcp, connect_tls;
+            res = curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &connect_dns);
+            if(CURLE_OK == res) 
+            {
+                fprintf(out, "\nTime it takes to do DNS: %.6f s\n", connect_dns);
+                res = curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect_tcp);
+                if(CURLE_OK == res) 
+                {
+                    fprintf(out, "\nTime it takes to do only TCP: %.6f s\n", connect_tcp - connect_dns);
+                    res = curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &connect_tls);
+                    if(CURLE_OK == res) 
+                    {
+                        fprintf(out, "\nTime it takes to do TCP + TLS: %.6f s\n", connect_tls - connect_dns);
+                    }
+                }
+            }
+            else
+            {
+                fprintf(out, "\nUnsupported option.\n");
+            }
         }
-
-        rc = select(1 + max, NULL, &fdset, NULL, timeout ? &to : NULL);
-        if (rc == -1) {
-            fprintf(stderr, "%s: select failed: %s\n",
-                    progname, strerror(errno));
-            exit(EXIT_FAILURE);
+        else
+        {
+            fprintf(out, "Couldn't connect to google :( \n");
         }
-
-        update(targets, &fdset);
+        curl_easy_cleanup(curl);
     }
 }
 
 /*
- * Sort the results for each target. This is in particular useful for
- * interactive usage.
+ * Carry out the queued commands of the control socket. This is only
+ * called between runs, when no probes are in flight and the ring of
+ * the writer thread has been drained, so no queued event refers to
+ * the targets being changed.
  */
 
-static int
-cmp(const void *a, const void *b)
+static void
+ctl_apply(void)
 {
-    endpoint_t *pa = (endpoint_t *) a;
-    endpoint_t *pb = (endpoint_t *) b;
+    ctl_op_t *op;
+    target_t *tp;
+    FILE *f;
+    char *buf;
+    size_t len;
+    int i, changed = 0;
+
+    while ((op = ctl_next())) {
+
+        switch (op->op) {
+        case CTL_ADD:
+            if (lookup(op->host, op->port)) {
+                ctl_printf(op->client, "error: target exists\n");
+                break;
+            }
+            tp = expand(op->host, op->port);
+            tp->every = op->arg;
+            if (tp->every) {
+                classes = 1;
+            }
+            append(tp);
+            evlog_target(tp);
+            changed = 1;
+            ctl_printf(op->client, "ok\n");
+            break;
+        case CTL_REMOVE:
+            tp = lookup(op->host, op->port);
+            if (! tp) {
+                ctl_printf(op->client, "error: no such target\n");
+                break;
+            }
+            for (i = 0; i < METRICS_CLIENTS; i++) {
+                if (metrics_clients[i].cursor == tp) {
+                    metrics_clients[i].cursor = tp->next;
+                }
+            }
+            detach(tp);
+            release(tp);
+            changed = 1;
+            ctl_printf(op->client, "ok\n");
+            break;
+        case CTL_DUMP:
+            if (! op->client) {
+                break;
+            }
+            f = open_memstream(&buf, &len);
+            if (! f) {
+                ctl_printf(op->client, "error: %s\n", strerror(errno));
+                break;
+            }
+            stats(targets, f);
+            (void) fclose(f);
+            ctl_printf(op->client, "%sok\n", buf);
+            free(buf);
+            break;
+        case CTL_FLUSH:
+            fflush(stdout);
+            if (evlog) {
+                fflush(evlog);
+            }
+            if (trace) {
+                fflush(trace);
+            }
+            ctl_printf(op->client, "ok\n");
+            break;
+        case CTL_HISTORY:
+            if (! op->client) {
+                break;
+            }
+            tp = op->host ? lookup(op->host, op->port) : targets;
+            if (op->host && ! tp) {
+                ctl_printf(op->client, "error: no such target\n");
+                break;
+            }
+            f = open_memstream(&buf, &len);
+            if (! f) {
+                ctl_printf(op->client, "error: %s\n", strerror(errno));
+                break;
+            }
+            history(targets, op->host ? tp : NULL, op->arg, f);
+            (void) fclose(f);
+            ctl_printf(op->client, "%sok\n", buf);
+            free(buf);
+            break;
+        }
 
-    if (! pa->tot || ! pb->tot) {
-        return 0;
+        if (op->client) {
+            op->client->pending--;
+        }
+        free(op->host);
+        free(op->port);
+        free(op);
     }
 
-    if (pa->sum/pa->tot < pb->sum/pb->tot) {
-        return -1;
-    } else if (pa->sum/pa->tot > pb->sum/pb->tot) {
-        return 1;
+    if (changed) {
+        metrics_begin(targets);
+        diag_begin(targets);
     }
-    return 0;
 }
 
+/*
+ * Forget the results of the previous run so that the resident targets
+ * can be probed again in continuous mode (-i). Cumulative statistics
+ * (metrics, live statistics) are kept.
+ */
+
 static void
-sort(target_t *targets)
+reset(target_t *targets)
 {
     target_t *tp;
     endpoint_t *ep;
 
-    assert(targets);
-
     for (tp = targets; target_valid(tp); tp = tp->next) {
-        if (tp->endpoints) {
-            qsort(tp->endpoints, tp->num_endpoints, sizeof(*ep), cmp);
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (ep->socket) {
+                (void) SYS(close(ep->socket));
+            }
+            ep->socket = 0;
+            ep->state = EP_STATE_NEW;
+            ep->sum = ep->tot = ep->idx = ep->cnt = 0;
+            ep->send = ep->rcvd = 0;
         }
+        tp->probed = 0;
     }
+    rounds_done = 0;
 }
 
 /*
- * Report the results. For each endpoint of a target, we show the time
- * measured to establish a connection. This default format is intended
- * primarily for human readers.
+ * Probe all targets nqueries times, optionally sort and pump, and
+ * produce the reports. With a replayed event log, there is nothing
+ * left to probe.
  */
 
 static void
-report(target_t *targets)
+run(target_t *targets, int probe)
 {
-    int i, n, len;
-    char host[NI_MAXHOST];
-    char serv[NI_MAXSERV];
-    target_t *tp;
-    endpoint_t *ep;
+    int i;
+    int64_t start;
 
-    assert(targets);
+    if (! targets) {
+	return;
+    }
+    if (probe && interval && (rate || classes) && ! schedule(targets)) {
+	return;
+    }
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+    /* sort() moves endpoints around, hence the writer has to drain
+     * all events referring to them before we sort */
+    if (probe && (smode || pmode)) {
+	for (i = rounds_done; i < nqueries && ! stopping; i++) {
+	    start = now_us();
+	    post_event(EV_ROUND, NULL, NULL, NULL, i, 0);
+	    engine.rounds++;
+	    if (fraction) {
+		sample(targets, engine.rounds);
+	    }
+	    live_round(i + 1);
+	    prof_enter(PH_PREPARE);
+	    prepare(targets);
+	    prof_leave();
+	    prof_enter(PH_COLLECT);
+	    collect(targets);
+	    prof_leave();
+	    post_span("round", "{\"round\":%d}", NULL, NULL,
+		      start, i + 1, 0);
+	    if (stopping) {
+		break;
+	    }
+	    rounds_done = i + 1;
+	    checkpoint(targets, 0);
+	    if (dumping) {
+		dump(targets);
+	    }
+	}
+	writer_drain();
+    }
+    if (smode) {
+	start = now_us();
+	prof_enter(PH_SORT);
+	sort(targets);
+	prof_leave();
+	post_span("sort", NULL, NULL, NULL, start, 0, 0);
+    }
+    if (probe && pmode && ! stopping) {
+	prof_enter(PH_PUMP);
+	pump(targets);
+	prof_leave();
+	writer_drain();
+    }
+    //Quic
+    if(qmode)
+    {
+	    printf("Quic here\n");//TODO quic connection etablieren
+    }
+    output(targets);
+    /* diagnostics should not wait for the end of continuous mode */
+    if (interval && diag.fd == -1) {
+	diag_print();
+    }
+    /* an interrupted run leaves the last checkpoint in place */
+    if (! stopping) {
+	rounds_done = nqueries;
+	checkpoint(targets, ! interval);
+    }
+}
 
-        printf("%s%s:%s\n",
-               (tp != targets) ? "\n" : "", tp->host, tp->port);
+/*
+ * Wait until the next run of the continuous mode is due while serving
+ * metrics requests and the control socket.
+ */
 
-        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+static void
+idle(int64_t due)
+{
+    fd_set rfds, wfds;
+    struct timeval to;
+    int64_t now;
+    int max;
 
-            n = getnameinfo((struct sockaddr *) &ep->addr,
-                            ep->addrlen,
-                            host, sizeof(host), serv, sizeof(serv),
-                            NI_NUMERICHOST | NI_NUMERICSERV);
-            if (n) {
-                fprintf(stderr, "%s: getnameinfo: %s\n",
-                        progname, gai_strerror(n));
+    ctl_apply();
+    while ((now = now_us()) < due && ! stopping) {
+        if (dumping) {
+            dump(targets);
+        }
+        FD_ZERO(&wfds);
+        max = metrics_fdset(&rfds, &wfds, -1);
+        max = ctl_fdset(&rfds, &wfds, max);
+        to.tv_sec = (due - now) / 1000000;
+        to.tv_usec = (due - now) % 1000000;
+        if (SYS(select(1 + max, &rfds, &wfds, NULL, &to)) == -1) {
+            if (errno == EINTR) {
                 continue;
             }
-            printf(" %s%n", host, &len);
-            printf("%*s", (42-len), "");
-            for (i = 0; i < ep->idx; i++) {
-                if (ep->values[i] >= 0) {
-                    printf(" %4u.%03u",
-                           ep->values[i] / 1000,
-                           ep->values[i] % 1000);
-                } else {
-                    printf("     *   ");
-                }
-            }
-            printf("\n");
+            diag_die(HAPPY_DIAG_SELECT, NULL);
         }
+        metrics_serve(&rfds, &wfds);
+        ctl_serve(&rfds, &wfds);
+        ctl_apply();
     }
 }
 
 /*
- * Report the pump results. For each endpoint of a target, we show the
- * bytes/seconds send and received.
+ * Sharding (-D, -J). A coordinator splits its target list into shards
+ * of SHARD_TARGETS targets and hands them to worker processes that
+ * connect to it over a Unix domain socket (an address containing a
+ * '/') or TCP ([addr:]port). The protocol is line based:
+ *
+ *     worker:       next
+ *     coordinator:  shard id count, followed by count lines host port
+ *                   or done
+ *     worker:       result id length, followed by length bytes of
+ *                   results, then next again
+ *
+ * Workers resolve and probe their shards with their own options and
+ * return the results in the format of a checkpoint (-k): a header and
+ * the records of the targets with their endpoints, hence workers have
+ * to be the same build of happy on the same kind of host. The
+ * coordinator puts the results into its own targets and, once all
+ * shards are done, reports them with its own options as if it had
+ * probed them. When no shard is left to hand out, an idle worker
+ * steals the shard that has been out the longest and the first result
+ * wins, so a slow or dead worker does not hold up the report. Workers
+ * that go away return their shard.
  */
 
-static void
-report_pump(target_t *targets)
-{
-    int n, len;
-    char host[NI_MAXHOST];
-    char serv[NI_MAXSERV];
-    target_t *tp;
-    endpoint_t *ep;
+#define SHARD_TARGETS		16
+#define SHARD_WORKERS		64
 
-    assert(targets);
+typedef struct shard {
+    target_t *first;
+    int count;
+    int assigned;			/* workers working on it */
+    int done;
+    int64_t started;			/* us, first handed out */
+} shard_t;
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+typedef struct shard_worker {
+    int fd;
+    int shard;				/* -1 if idle */
+    int waiting;			/* has asked for the next shard */
+    int receiving;			/* reading a result */
+    unsigned int id;			/* shard of the result */
+    size_t want;			/* bytes of the result missing */
+    char *in;
+    size_t inlen;
+    size_t insize;
+} shard_worker_t;
+
+static char *shard_path = NULL;		/* Unix socket of the coordinator */
 
-        printf("%s%s:%s\n",
-               (tp != targets) ? "\n" : "", tp->host, tp->port);
+/*
+ * Create the listening socket of the coordinator (passive) or connect
+ * a worker to the coordinator.
+ */
 
-        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-            n = getnameinfo((struct sockaddr *) &ep->addr,
-                            ep->addrlen,
-                            host, sizeof(host), serv, sizeof(serv),
-                            NI_NUMERICHOST | NI_NUMERICSERV);
-            if (n) {
-                fprintf(stderr, "%s: getnameinfo: %s\n",
-                        progname, gai_strerror(n));
-                continue;
+static int
+shard_socket(const char *spec, int passive)
+{
+    struct sockaddr_un sun;
+    struct addrinfo hints, *ai;
+    char *addr, *port;
+    int n, fd, on = 1;
+
+    if (strchr(spec, '/')) {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(spec) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "%s: shard socket path too long\n", progname);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(sun.sun_path, spec);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (passive) {
+            (void) unlink(spec);
+            shard_path = xstrdup(spec);
+            n = (fd == -1
+                 || bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1
+                 || listen(fd, SHARD_WORKERS) == -1);
+        } else {
+            n = (fd == -1
+                 || connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1);
+        }
+    } else {
+        addr = xstrdup(spec);
+        port = strrchr(addr, ':');
+        if (port) {
+            *port++ = 0;
+            if (addr[0] == '[' && addr[strlen(addr) - 1] == ']') {
+                addr[strlen(addr) - 1] = 0;
+                memmove(addr, addr + 1, strlen(addr));
             }
-            printf(" %s%n", host, &len);
-            printf("%*s", (42-len), "");
-            printf(" %4u.%03u [sent]",
-                   ep->send / pump_timeout * 1000 / 1000,
-                   ep->send / pump_timeout * 1000 % 1000);
-            printf(" %4u.%03u [rcvd]",
-                   ep->rcvd / pump_timeout * 1000 / 1000,
-                   ep->rcvd / pump_timeout * 1000 % 1000);
-            printf("\n");
+        } else {
+            port = addr;
+        }
+        /* without a host, the coordinator only listens on the
+         * loopback interface, as anyone reaching it can take part */
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        n = getaddrinfo((port == addr || ! *addr) ? NULL : addr, port,
+                        &hints, &ai);
+        if (n != 0) {
+            fprintf(stderr, "%s: getaddrinfo: %s (shard %s)\n",
+                    progname, gai_strerror(n), spec);
+            exit(EXIT_FAILURE);
+        }
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (passive) {
+            n = (fd == -1
+                 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+                               &on, sizeof(on)) == -1
+                 || bind(fd, ai->ai_addr, ai->ai_addrlen) == -1
+                 || listen(fd, SHARD_WORKERS) == -1);
+        } else {
+            n = (fd == -1 || connect(fd, ai->ai_addr, ai->ai_addrlen) == -1);
         }
+        freeaddrinfo(ai);
+        free(addr);
+    }
+    if (n) {
+        fprintf(stderr, "%s: shard %s: %s\n", progname, spec, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* peers going away must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+    return fd;
+}
+
+static void
+shard_close(shard_worker_t *w, shard_t *shards)
+{
+    if (w->shard != -1) {
+        shards[w->shard].assigned--;
     }
+    (void) close(w->fd);
+    free(w->in);
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
 }
 
 /*
- * Report the dns results. For each endpoint of a target, we show the
- * canonical name and the reverse name.
+ * Hand the next shard to a waiting worker: a shard nobody works on,
+ * or else the one whose only worker has had it the longest. Returns
+ * 0 if there is nothing to hand out right now.
  */
 
-static void
-report_dns(target_t *targets)
+static int
+shard_assign(shard_worker_t *w, shard_t *shards, int nshards)
 {
-    int n, len;
-    char host[NI_MAXHOST];
-    char serv[NI_MAXSERV];
+    int i, pick = -1;
     target_t *tp;
-    endpoint_t *ep;
-
-    assert(targets);
+    FILE *f;
+    char *buf;
+    size_t len;
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+    for (i = 0; i < nshards; i++) {
+        if (! shards[i].done && ! shards[i].assigned) {
+            pick = i;
+            break;
+        }
+    }
+    if (pick == -1) {
+        for (i = 0; i < nshards; i++) {
+            if (! shards[i].done && shards[i].assigned == 1
+                && (pick == -1
+                    || shards[i].started < shards[pick].started)) {
+                pick = i;
+            }
+        }
+    }
+    if (pick == -1) {
+        return 0;
+    }
 
-	printf("%s%s:%s\n",
-	       (tp != targets) ? "\n" : "", tp->host, tp->port);
+    f = open_memstream(&buf, &len);
+    if (! f) {
+        fprintf(stderr, "%s: open_memstream: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(f, "shard %d %d\n", pick, shards[pick].count);
+    for (i = 0, tp = shards[pick].first; i < shards[pick].count;
+         i++, tp = tp->next) {
+        fprintf(f, "%s %s\n", tp->host, tp->port);
+    }
+    (void) fclose(f);
+    /* the worker is waiting for it, so this does not block for long */
+    if (write(w->fd, buf, len) != (ssize_t) len) {
+        free(buf);
+        shard_close(w, shards);
+        return 1;
+    }
+    free(buf);
 
-	for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-	    n = getnameinfo((struct sockaddr *) &ep->addr,
-			    ep->addrlen,
-			    host, sizeof(host), serv, sizeof(serv),
-			    NI_NUMERICHOST | NI_NUMERICSERV);
-	    if (n) {
-		fprintf(stderr, "%s: getnameinfo: %s\n",
-			progname, gai_strerror(n));
-		continue;
-	    }
-	    printf(" %s > %s%n", ep->canonname, host, &len);
-	    if (ep->reversename) {
-		printf(" > %s", ep->reversename);
-	    }
-	    printf("\n");
-	}
+    if (! shards[pick].assigned) {
+        shards[pick].started = now_us();
     }
+    shards[pick].assigned++;
+    w->shard = pick;
+    w->waiting = 0;
+    return 1;
 }
 
 /*
- * Report the results. This function produces a more compact semicolon
- * separated output format intended for consumption by other programs.
+ * Put the results of a shard returned by a worker into the targets of
+ * the shard. Returns -1 if they are malformed or do not fit, e.g. if
+ * the worker has been run with another number of queries.
  */
 
-static void
-report_sk(target_t *targets)
+static int
+shard_merge(shard_t *sp, char *buf, size_t len)
 {
-    int i, n;
-    char host[NI_MAXHOST];
-    char serv[NI_MAXSERV];
-    target_t *tp;
-    endpoint_t *ep;
-    time_t now;
+    FILE *f;
+    ckpt_header_t hdr;
+    target_t **loaded, *tp, *np;
+    endpoint_t *endpoints;
+    tstats_t *stats;
+    int i, n = 0, rc = -1;
 
-    assert(targets);
+    if (len < sizeof(hdr)) {
+        return -1;
+    }
+    f = fmemopen(buf, len, "r");
+    if (! f) {
+        fprintf(stderr, "%s: fmemopen: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    loaded = xcalloc(sp->count, sizeof(*loaded));
+    if (ckpt_read(f, &hdr, sizeof(hdr)) || ! ckpt_compatible(&hdr)
+        || hdr.nqueries != nqueries || hdr.num_targets != sp->count) {
+        goto done;
+    }
+    for (tp = sp->first; n < sp->count; n++, tp = tp->next) {
+        loaded[n] = ckpt_load(f);
+        if (! loaded[n] || strcmp(loaded[n]->host, tp->host) != 0
+            || strcmp(loaded[n]->port, tp->port) != 0) {
+            n += loaded[n] != NULL;
+            goto done;
+        }
+    }
 
-    now = time(NULL);
+    /* the loaded targets take over what the targets of the shard had
+     * and are released in their place */
+    for (i = 0, tp = sp->first; i < sp->count; i++, tp = tp->next) {
+        np = loaded[i];
+        endpoints = tp->endpoints;
+        stats = tp->stats;
+        tp->endpoints = np->endpoints;
+        tp->num_endpoints = np->num_endpoints;
+        tp->stats = np->stats;
+        tp->probed = np->probed;
+        np->endpoints = endpoints;
+        np->stats = stats;
+    }
+    rc = 0;
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+done:
+    for (i = 0; i < n; i++) {
+        release(loaded[i]);
+    }
+    free(loaded);
+    (void) fclose(f);
+    return rc;
+}
 
-	if (! tp->endpoints) {
-            printf("HAPPY.0.4;%lu;%s;%s;%s\n",
-                   now, "FAIL", tp->host, tp->port);
-	}
+/*
+ * Process the lines and results a worker has sent. Results are only
+ * taken for the shard handed to the worker. Returns -1 if the
+ * worker has to be dropped.
+ */
 
-        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+static int
+shard_input(shard_worker_t *w, shard_t *shards, int *ndone)
+{
+    char *nl;
+    size_t n;
+    shard_t *sp;
 
-            n = getnameinfo((struct sockaddr *) &ep->addr,
-                            ep->addrlen,
-                            host, sizeof(host), serv, sizeof(serv),
-                            NI_NUMERICHOST | NI_NUMERICSERV);
-            if (n) {
-                fprintf(stderr, "%s: getnameinfo: %s\n",
-                        progname, gai_strerror(n));
-                continue;
+    while (1) {
+        if (w->receiving) {
+            if (w->inlen < w->want) {
+                break;
             }
-
-            printf("HAPPY.0.4;%lu;%s;%s;%s;%s",
-                   now, ep->cnt ? "OK" : "FAIL", tp->host, tp->port, host);
-            for (i = 0; i < ep->idx; i++) {
-                printf(";%d", ep->values[i]);
+            sp = &shards[w->shard];
+            if (! sp->done) {
+                if (shard_merge(sp, w->in, w->want) == -1) {
+                    fprintf(stderr, "%s: shard %u: dropping a worker with "
+                            "incompatible results\n", progname, w->id);
+                    return -1;
+                }
+                sp->done = 1;
+                (*ndone)++;
+            }
+            sp->assigned--;
+            w->shard = -1;
+            n = w->want;
+            w->receiving = 0;
+        } else {
+            nl = memchr(w->in, '\n', w->inlen);
+            if (! nl) {
+                break;
             }
-            printf("\n");
+            *nl = 0;
+            if (strcmp(w->in, "next") == 0) {
+                w->waiting = 1;
+            } else if (sscanf(w->in, "result %u %zu", &w->id, &w->want) == 2) {
+                /* a worker only returns the shard it was handed */
+                if (w->shard == -1 || w->id != (unsigned int) w->shard) {
+                    fprintf(stderr, "%s: shard %u: dropping a worker with "
+                            "a result for another shard\n", progname, w->id);
+                    return -1;
+                }
+                w->receiving = 1;
+            } else {
+                return -1;
+            }
+            n = nl + 1 - w->in;
         }
+        w->inlen -= n;
+        memmove(w->in, w->in + n, w->inlen);
     }
+    return 0;
 }
 
 /*
- * Report the pump results. This function produces a more compact
- * semicolon separated output format intended for consumption by other
- * programs.
+ * Run the coordinator until all shards are done and report the merged
+ * results.
  */
 
 static void
-report_pump_sk(target_t *targets)
+shard_serve(target_t *targets)
 {
-    int n;
-    char host[NI_MAXHOST];
-    char serv[NI_MAXSERV];
+    shard_worker_t workers[SHARD_WORKERS];
+    shard_t *shards;
+    int nshards = 0, ndone = 0, i, fd, max;
     target_t *tp;
-    endpoint_t *ep;
-    time_t now;
+    fd_set rfds;
+    ssize_t n;
+    char *note;
+
+    for (tp = targets, i = 0; target_valid(tp); tp = tp->next, i++) ;
+    nshards = (i + SHARD_TARGETS - 1) / SHARD_TARGETS;
+    shards = xcalloc(nshards + 1, sizeof(*shards));
+    for (tp = targets, i = 0; target_valid(tp); tp = tp->next, i++) {
+        if (i % SHARD_TARGETS == 0) {
+            shards[i / SHARD_TARGETS].first = tp;
+        }
+        shards[i / SHARD_TARGETS].count++;
+    }
+    for (i = 0; i < SHARD_WORKERS; i++) {
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].fd = -1;
+    }
 
-    assert(targets);
+    while (ndone < nshards && ! stopping) {
+        FD_ZERO(&rfds);
+        FD_SET(shard_lfd, &rfds);
+        max = shard_lfd;
+        for (i = 0; i < SHARD_WORKERS; i++) {
+            if (workers[i].fd != -1) {
+                FD_SET(workers[i].fd, &rfds);
+                max = workers[i].fd > max ? workers[i].fd : max;
+            }
+        }
+        if (select(1 + max, &rfds, NULL, NULL, NULL) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: select: %s\n", progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
 
-    now = time(NULL);
+        if (FD_ISSET(shard_lfd, &rfds)) {
+            fd = accept(shard_lfd, NULL, NULL);
+            for (i = 0; fd != -1 && i < SHARD_WORKERS; i++) {
+                if (workers[i].fd == -1) {
+                    workers[i].fd = fd;
+                    workers[i].shard = -1;
+                    break;
+                }
+            }
+            if (fd != -1 && i == SHARD_WORKERS) {
+                (void) close(fd);
+            }
+        }
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+        for (i = 0; i < SHARD_WORKERS; i++) {
+            shard_worker_t *w = &workers[i];
 
-	if (! tp->endpoints) {
-            printf("PUMP.0.4;%lu;%s;%s;%s\n",
-                   now, "FAIL", tp->host, tp->port);
-	}
+            if (w->fd == -1 || ! FD_ISSET(w->fd, &rfds)) {
+                continue;
+            }
+            if (w->insize - w->inlen < 4096) {
+                w->insize = w->insize ? 2 * w->insize : 8192;
+                w->in = xrealloc(w->in, w->insize);
+            }
+            n = read(w->fd, w->in + w->inlen, w->insize - w->inlen);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                shard_close(w, shards);
+                continue;
+            }
+            w->inlen += n;
+            if (shard_input(w, shards, &ndone) == -1) {
+                shard_close(w, shards);
+            }
+        }
 
-        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+        for (i = 0; i < SHARD_WORKERS; i++) {
+            if (workers[i].fd != -1 && workers[i].waiting) {
+                (void) shard_assign(&workers[i], shards, nshards);
+            }
+        }
+    }
 
-            n = getnameinfo((struct sockaddr *) &ep->addr,
-                            ep->addrlen,
-                            host, sizeof(host), serv, sizeof(serv),
-                            NI_NUMERICHOST | NI_NUMERICSERV);
-            if (n) {
-                fprintf(stderr, "%s: getnameinfo: %s\n",
-                        progname, gai_strerror(n));
-                continue;
+    /* workers still busy with stolen shards learn from the closed
+     * connection that there is nothing left */
+    for (i = 0; i < SHARD_WORKERS; i++) {
+        if (workers[i].fd != -1) {
+            if (workers[i].waiting) {
+                (void) write(workers[i].fd, "done\n", 5);
             }
+            shard_close(&workers[i], shards);
+        }
+    }
 
-            printf("PUMP.0.4;%lu;%s;%s;%s;%s",
-                   now, ep->cnt ? "OK" : "FAIL", tp->host, tp->port, host);
-            printf(";%u.%03u",
-                   ep->send / pump_timeout * 1000 / 1000,
-                   ep->send / pump_timeout * 1000 % 1000);
-            printf(";%u.%03u",
-                   ep->rcvd / pump_timeout * 1000 / 1000,
-                   ep->rcvd / pump_timeout * 1000 % 1000);
-            printf("\n");
+    /* the targets of shards not done are not reported */
+    rounds_done = nqueries;
+    output(targets);
+    if (ndone < nshards) {
+        if (skmode) {
+            xasprintf(&note, "PARTIAL.0.4;%lu;%d;%d\n",
+                      (unsigned long) time(NULL), ndone, nshards);
+        } else {
+            xasprintf(&note, "\n(interrupted after %d of %d shards)\n",
+                      ndone, nshards);
+        }
+        if (append_fd != -1) {
+            append_write(append_fd, note, strlen(note));
+        } else {
+            lock(stdout);
+            fputs(note, stdout);
+            fflush(stdout);
+            unlock(stdout);
         }
+        free(note);
+    }
+    free(shards);
+
+    (void) close(shard_lfd);
+    shard_lfd = -1;
+    if (shard_path) {
+        (void) unlink(shard_path);
+        free(shard_path);
     }
 }
 
 /*
- * Report the dns results. This function produces a more compact
- * semicolon separated output format intended for consumption by other
- * programs.
+ * Run as a worker: ask the coordinator for shards, probe them and
+ * return the results until the coordinator has nothing left.
  */
 
+static int
+shard_send(const char *buf, size_t len)
+{
+    ssize_t rc;
+
+    while (len) {
+        rc = write(shard_fd, buf, len);
+        if (rc == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
 static void
-report_dns_sk(target_t *targets)
+shard_work(void)
 {
-    int n;
-    char host[NI_MAXHOST];
-    char serv[NI_MAXSERV];
+    FILE *in, *f;
+    char line[1024], host[NI_MAXHOST], port[NI_MAXSERV];
+    unsigned int id, count, i;
     target_t *tp;
-    endpoint_t *ep;
-    time_t now;
-
-    assert(targets);
+    ckpt_header_t hdr;
+    char *buf;
+    size_t len;
+    int rc;
 
-    now = time(NULL);
+    in = fdopen(shard_fd, "r");
+    if (! in) {
+        fprintf(stderr, "%s: fdopen: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+    /* a coordinator that has closed the connection has nothing left,
+     * it may already have the results of a stolen shard */
+    while (! stopping && shard_send("next\n", 5) == 0) {
+        if (! fgets(line, sizeof(line), in) || strcmp(line, "done\n") == 0) {
+            break;
+        }
+        if (sscanf(line, "shard %u %u", &id, &count) != 2) {
+            fprintf(stderr, "%s: shard: unexpected '%s'\n",
+                    progname, trim(line));
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < count; i++) {
+            if (! fgets(line, sizeof(line), in)
+                || sscanf(line, "%1024s %31s", host, port) != 2) {
+                fprintf(stderr, "%s: shard: truncated shard %u\n",
+                        progname, id);
+                exit(EXIT_FAILURE);
+            }
+            tp = expand(host, port);
+            append(tp);
+            if (evlog) {
+                evlog_target(tp);
+            }
+        }
 
-	if (! tp->endpoints) {
-            printf("DNS.0.4;%lu;%s;%s;%s\n",
-                   now, "FAIL", tp->host, tp->port);
-	}
+        rounds_done = 0;
+        run(targets, 1);
 
-	for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+        f = open_memstream(&buf, &len);
+        if (! f) {
+            fprintf(stderr, "%s: open_memstream: %s\n",
+                    progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        ckpt_header(&hdr, count);
+        rc = ckpt_write(f, &hdr, sizeof(hdr));
+        for (tp = targets; target_valid(tp) && ! rc; tp = tp->next) {
+            rc = ckpt_save(f, tp);
+        }
+        (void) fclose(f);
 
-	    n = getnameinfo((struct sockaddr *) &ep->addr,
-			    ep->addrlen,
-			    host, sizeof(host), serv, sizeof(serv),
-			    NI_NUMERICHOST | NI_NUMERICSERV);
-	    if (n) {
-		fprintf(stderr, "%s: getnameinfo: %s\n",
-			progname, gai_strerror(n));
-		continue;
-	    }
+        while ((tp = targets)) {
+            detach(tp);
+            release(tp);
+        }
+        pool_free();
 
-	    printf("DNS.0.4;%lu;%s;%s;%s;%s;%s",
-		   now, ep->cnt ? "OK" : "FAIL", tp->host, host,
-		   ep->canonname ? ep->canonname : "",
-		   ep->reversename ? ep->reversename : "");
-	    printf("\n");
-	}
+        snprintf(line, sizeof(line), "result %u %zu\n", id, len);
+        rc = rc || shard_send(line, strlen(line)) == -1
+            || shard_send(buf, len) == -1;
+        free(buf);
+        if (rc) {
+            break;
+        }
     }
+    (void) fclose(in);
+    shard_fd = -1;
 }
 
 /*
- * Cleanup targets and release all target data structures.
+ * Resident server (-Z) and thin clients (-z). Each invocation of happy
+ * pays for exec, the curl probe and the resolver setup before it
+ * probes anything, which adds up for frequent small runs. A server
+ * pays for them once and then accepts clients on a Unix domain socket.
+ * A client passes its standard input, output and error descriptors
+ * (SCM_RIGHTS), its working directory and its arguments; the server
+ * forks a child that runs the arguments exactly like a fresh happy
+ * process on the client's descriptors, so the output is the same and
+ * -f - reads the client's standard input. The server sends the exit
+ * status of the child back, which becomes the client's exit status.
+ * An interrupted client asks the server to interrupt the child; a
+ * client that goes away has its child terminated. Since a child can
+ * do anything happy can, the socket is only accessible to our user
+ * and clients of other users are turned away. Requests are read from
+ * the select() loop as they arrive, so a slow client holds up nobody.
  */
 
+#define SERVE_CLIENTS		64
+#define SERVE_MAX		(16 * 1024 * 1024)	/* bytes of arguments */
+
+typedef struct serve_client {
+    int fd;				/* -1 once the client has gone */
+    pid_t pid;				/* 0 while reading the request */
+    int fds[3];				/* descriptors of the client, -1 */
+    uint32_t len;			/* of the data, 0 until received */
+    uint32_t got;
+    char *data;
+} serve_client_t;
+
+static int served = 0;			/* we run for a client of -Z */
+static char *curl_text = NULL;		/* output of the curl probe */
+static size_t curl_len = 0;
+static volatile sig_atomic_t client_fd = -1;
+
 static void
-cleanup(target_t *targets)
+on_child(int sig)
 {
-    target_t *tp, *np;
-    endpoint_t *ep;
+    (void) sig;
+}
 
-    assert(targets);
+static void
+on_client_signal(int sig)
+{
+    (void) sig;
+    if (client_fd != -1) {
+        (void) write(client_fd, "i", 1);
+    }
+}
 
-    for (tp = targets; target_valid(tp); tp = np) {
-	np = tp->next;
-	for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-	    if (ep->socket) {
-		(void) close(ep->socket);
-	    }
-	    if (ep->values) {
-		(void) free(ep->values);
-	    }
-	    if (ep->canonname) {
-		(void) free(ep->canonname);
-	    }
-	    if (ep->reversename) {
-		(void) free(ep->reversename);
-	    }
-	}
-	if (tp->endpoints) (void) free(tp->endpoints);
-	if (tp->host) (void) free(tp->host);
-	if (tp->port) (void) free(tp->port);
-	(void) free(tp);
+static int
+serve_read(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (char *) buf + n;
+        len -= n;
     }
+    return 0;
 }
 
 /*
- * Read a list of targets from a file or standard input if the
- * filename is '-'.
+ * Forget a client, closing what we hold of it.
  */
 
 static void
-import(const char *filename, char **ports)
+serve_drop(serve_client_t *sc)
 {
-    FILE *in;
-    char line[512], *host;
-    int j;
+    int i;
 
-    if (! filename || strcmp(filename, "-") == 0) {
-        clearerr(stdin);
-        in = stdin;
-    } else {
-        in = fopen(filename, "r");
-        if (! in) {
-            fprintf(stderr, "%s: fopen: %s\n",
-                    progname, strerror(errno));
-            exit(EXIT_FAILURE);
+    for (i = 0; i < 3; i++) {
+        if (sc->fds[i] != -1) {
+            (void) close(sc->fds[i]);
         }
     }
+    if (sc->fd != -1) {
+        (void) close(sc->fd);
+    }
+    free(sc->data);
+    memset(sc, 0, sizeof(*sc));
+    sc->fd = sc->fds[0] = sc->fds[1] = sc->fds[2] = -1;
+}
 
-    while (fgets(line, sizeof(line), in)) {
-        host = trim(line);
-        if (*host) {
-            for (j = 0; ports[j]; j++) {
-                append(expand(host, ports[j]));
-            }
+/*
+ * Receive what has arrived of the request of a client: first the
+ * descriptors with the length of the data, then the working directory
+ * and the arguments, all terminated by NUL characters. Returns 1 once
+ * the request is complete, 0 if more is to come and -1 if the client
+ * is to be dropped.
+ */
+
+static int
+serve_recv(serve_client_t *sc)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    uint32_t len;
+    ssize_t n;
+
+    if (! sc->len) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &len;
+        iov.iov_len = sizeof(len);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        n = recvmsg(sc->fd, &msg, 0);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK
+                        || errno == EINTR)) {
+            return 0;
+        }
+        /* the length and the descriptors are sent in one message */
+        cmsg = n == sizeof(len) ? CMSG_FIRSTHDR(&msg) : NULL;
+        if (! cmsg || cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+            return -1;
+        }
+        memcpy(sc->fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+        if (! len || len > SERVE_MAX) {
+            return -1;
         }
+        sc->len = len;
+        sc->data = xcalloc(1, len + 1);
+        return 0;
+    }
+
+    n = read(sc->fd, sc->data + sc->got, sc->len - sc->got);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK
+                    || errno == EINTR)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    sc->got += n;
+    if (sc->got < sc->len) {
+        return 0;
     }
+    return sc->data[sc->len - 1] ? -1 : 1;
+}
 
-    if (ferror(in)) {
-        fprintf(stderr, "%s: ferror: %s\n",
-                progname, strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+static void
+serve_status(serve_client_t *sc, int status)
+{
+    int32_t code;
 
-    if (in != stdin) {
-        fclose(in);
+    code = WIFEXITED(status) ? WEXITSTATUS(status)
+        : 128 + WTERMSIG(status);
+    if (sc->fd != -1) {
+        /* the client waits for it, the socket buffer has room */
+        (void) write(sc->fd, &code, sizeof(code));
     }
-
+    serve_drop(sc);
 }
 
 /*
- * Pump connections with HTTP GET requests and measure the datarate
- * (throughput) of the stream of responses.
+ * Run the server. Returns only in a child, with the arguments of the
+ * client in place of our own.
  */
 
 static void
-pump(target_t *targets)
+serve(const char *path, int *pargc, char ***pargv)
 {
-    static char const template[] =
-    "GET / HTTP/1.1\r\n"
-    "Host: %s\r\n"
-    "User-Agent: pump/0.1\r\n"
-    "Cache-Control: no-cache\r\n"
-    "Connection: Keep-Alive\r\n"
-    "\r\n";
-
-    static char *msg;
-    target_t *tp, *np;
-    endpoint_t *ep;
-    struct timeval ts, tn, td;
-    fd_set rfds, wfds;
-    char buffer[8192];
-    unsigned int us;
-    int rc;
+    struct sockaddr_un sun;
+    struct sigaction sa;
+    struct ucred cred;
+    socklen_t credlen;
+    serve_client_t clients[SERVE_CLIENTS], *sc;
+    sigset_t mask, orig;
+    fd_set rfds;
+    mode_t mode;
+    FILE *curl_out;
+    int lfd, fd, max, i, j, n, status;
+    char *p, **argv, c;
+    pid_t pid;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s: server socket path too long\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(sun.sun_path, path);
+    (void) unlink(path);
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode = umask(0077);
+    n = (lfd == -1
+         || bind(lfd, (struct sockaddr *) &sun, sizeof(sun)) == -1
+         || listen(lfd, SERVE_CLIENTS) == -1);
+    (void) umask(mode);
+    if (n) {
+        fprintf(stderr, "%s: server %s: %s\n",
+                progname, path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    assert(targets);
+    /* what every client would otherwise pay for; the text of the curl
+     * probe is kept for the output of every child */
+    curl_out = open_memstream(&curl_text, &curl_len);
+    if (! curl_out) {
+        fprintf(stderr, "%s: open_memstream: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    curl_probe(curl_out);
+    (void) fclose(curl_out);
+    (void) res_init();
 
-    /* ignore SIGPIPE, handle locally the returned EPIPE error */
     signal(SIGPIPE, SIG_IGN);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_child;
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    (void) sigaction(SIGCHLD, &sa, NULL);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    (void) sigprocmask(SIG_BLOCK, &mask, &orig);
+
+    for (i = 0; i < SERVE_CLIENTS; i++) {
+        memset(&clients[i], 0, sizeof(clients[i]));
+        clients[i].fd = -1;
+        clients[i].fds[0] = clients[i].fds[1] = clients[i].fds[2] = -1;
+    }
 
-    for (tp = targets; target_valid(tp); tp = np) {
-        np = tp->next;
-        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-            if (ep->state != EP_STATE_CONNECTED) {
-                continue;
+    while (! stopping) {
+        FD_ZERO(&rfds);
+        FD_SET(lfd, &rfds);
+        max = lfd;
+        for (i = 0; i < SERVE_CLIENTS; i++) {
+            if (clients[i].fd != -1) {
+                FD_SET(clients[i].fd, &rfds);
+                max = clients[i].fd > max ? clients[i].fd : max;
             }
-            msg = malloc(strlen(template)+strlen(tp->host));
-            if (! msg) {
-                fprintf(stderr, "%s: malloc failed for %s\n",
-                        progname, tp->host);
+        }
+        n = pselect(1 + max, &rfds, NULL, NULL, NULL, &orig);
+        if (n == -1 && errno != EINTR) {
+            fprintf(stderr, "%s: pselect: %s\n", progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < SERVE_CLIENTS; i++) {
+                if (clients[i].pid == pid) {
+                    serve_status(&clients[i], status);
+                }
+            }
+        }
+        if (n == -1) {
+            continue;
+        }
+
+        for (i = 0; i < SERVE_CLIENTS; i++) {
+            sc = &clients[i];
+            if (sc->fd == -1 || ! FD_ISSET(sc->fd, &rfds)) {
                 continue;
             }
-            snprintf(msg, strlen(template)+strlen(tp->host), template, tp->host);
 
-            (void) gettimeofday(&ts, NULL);
-            us = 0;
-            while (us < pump_timeout * 1000) {
-                FD_ZERO(&rfds);
-                FD_SET(ep->socket, &rfds);
-                FD_ZERO(&wfds);
-                FD_SET(ep->socket, &wfds);
-                ssize_t sent = 0;
-                ssize_t received = 0;
-                rc = select(1 + ep->socket, &rfds, &wfds, NULL, NULL);
-                if (rc == -1) {
-                    fprintf(stderr, "%s: select failed: %s\n",
-                            progname, strerror(errno));
-                    exit(EXIT_FAILURE);
+            /* a byte asks to interrupt the child, end of file means
+             * the client has gone */
+            if (sc->pid) {
+                n = read(sc->fd, &c, 1);
+                if (n == 1) {
+                    (void) kill(sc->pid, SIGINT);
+                } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK
+                                      && errno != EINTR)) {
+                    (void) kill(sc->pid, SIGTERM);
+                    (void) close(sc->fd);
+                    sc->fd = -1;
                 }
+                continue;
+            }
 
-                if (FD_ISSET(ep->socket, &rfds)) {
-                    received = recv(ep->socket, buffer, sizeof(buffer), 0);
-                    if(received<0) {
-                        fprintf(stderr, "recverr (%s): %s\n", tp->host, strerror(errno));
-                        if (errno == EPIPE) break;
-                    } else {
-                        ep->rcvd += received;
+            n = serve_recv(sc);
+            if (n == -1) {
+                serve_drop(sc);
+            }
+            if (n != 1) {
+                continue;
+            }
+
+            pid = fork();
+            if (pid == 0) {
+                served = 1;
+                (void) close(lfd);
+                for (j = 0; j < SERVE_CLIENTS; j++) {
+                    if (j != i) {
+                        serve_drop(&clients[j]);
                     }
                 }
-
-                if (FD_ISSET(ep->socket, &wfds)) {
-                    sent = send(ep->socket, msg, strlen(msg), 0);
-                    if(sent<0) {
-                        fprintf(stderr, "senderr (%s): %s\n", tp->host, strerror(errno));
-                        if (errno == EPIPE) break;
-                    } else {
-                        ep->send += sent;
+                (void) close(sc->fd);
+                for (j = 0; j < 3; j++) {
+                    if (dup2(sc->fds[j], j) == -1) {
+                        _exit(EXIT_FAILURE);
+                    }
+                }
+                for (j = 0; j < 3; j++) {
+                    if (sc->fds[j] > 2) {
+                        (void) close(sc->fds[j]);
                     }
                 }
+                signal(SIGCHLD, SIG_DFL);
+                signal(SIGPIPE, SIG_DFL);
+                (void) sigprocmask(SIG_SETMASK, &orig, NULL);
 
-                (void) gettimeofday(&tn, NULL);
-                timersub(&tn, &ts, &td);
-                us = td.tv_sec*1000000 + td.tv_usec;
+                if (chdir(sc->data) == -1) {
+                    fprintf(stderr, "%s: chdir: %s\n",
+                            progname, strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                for (n = 0, p = sc->data; p < sc->data + sc->len;
+                     p += strlen(p) + 1) {
+                    n++;
+                }
+                argv = xcalloc(n + 1, sizeof(char *));
+                argv[0] = (*pargv)[0];
+                for (n = 1, p = sc->data + strlen(sc->data) + 1;
+                     p < sc->data + sc->len; p += strlen(p) + 1) {
+                    argv[n++] = p;
+                }
+                *pargc = n;
+                *pargv = argv;
+                return;
             }
 
-            if (ep->socket) {
-                (void) close(ep->socket);
+            for (j = 0; j < 3; j++) {
+                (void) close(sc->fds[j]);
+                sc->fds[j] = -1;
             }
+            free(sc->data);
+            sc->data = NULL;
+            if (pid == -1) {
+                fprintf(stderr, "%s: fork: %s\n", progname, strerror(errno));
+                serve_drop(sc);
+                continue;
+            }
+            sc->pid = pid;
+        }
+
+        if (! FD_ISSET(lfd, &rfds)) {
+            continue;
+        }
+        fd = accept(lfd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        for (i = 0; i < SERVE_CLIENTS
+                 && (clients[i].fd != -1 || clients[i].pid); i++) ;
+        credlen = sizeof(cred);
+        if (i == SERVE_CLIENTS
+            || getsockopt(fd, SOL_SOCKET, SO_PEERCRED,
+                          &cred, &credlen) == -1
+            || cred.uid != geteuid()
+            || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+            (void) close(fd);
+            continue;
+        }
+        clients[i].fd = fd;
+    }
 
-            free(msg);
+    /* let the runs in progress finish */
+    (void) close(lfd);
+    (void) unlink(path);
+    while ((pid = waitpid(-1, &status, 0)) > 0 || errno == EINTR) {
+        for (i = 0; pid > 0 && i < SERVE_CLIENTS; i++) {
+            if (clients[i].pid == pid) {
+                serve_status(&clients[i], status);
+            }
         }
     }
+    exit(EXIT_SUCCESS);
 }
 
+/*
+ * Run as a client of a server: hand over our descriptors, working
+ * directory and arguments and return the exit status of the run.
+ */
 
-size_t write_data(void *buffer, size_t size, size_t nmemb, void *userp)
+static int
+client(const char *path, int argc, char **argv)
 {
-    /*Since we are not interested in the response just do nothing here.*/
-    return size * nmemb;
+    struct sockaddr_un sun;
+    struct sigaction sa;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    int fd, i, fds[3] = { 0, 1, 2 };
+    char cwd[PATH_MAX];
+    char *data;
+    size_t size;
+    uint32_t len;
+    int32_t code;
+    FILE *f;
+
+    if (! getcwd(cwd, sizeof(cwd))) {
+        fprintf(stderr, "%s: getcwd: %s\n", progname, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    f = open_memstream(&data, &size);
+    if (! f) {
+        fprintf(stderr, "%s: open_memstream: %s\n", progname, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fwrite(cwd, 1, strlen(cwd) + 1, f);
+    for (i = 0; i < argc; i++) {
+        fwrite(argv[i], 1, strlen(argv[i]) + 1, f);
+    }
+    (void) fclose(f);
+    if (size > SERVE_MAX) {
+        fprintf(stderr, "%s: too many arguments for the server\n", progname);
+        return EXIT_FAILURE;
+    }
+    len = size;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s: server socket path too long\n", progname);
+        return EXIT_FAILURE;
+    }
+    strcpy(sun.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+        fprintf(stderr, "%s: server %s: %s\n",
+                progname, path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* a server that turns us away must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &msg, 0) != sizeof(len)
+        || write(fd, data, size) != (ssize_t) size) {
+        fprintf(stderr, "%s: server %s: %s\n",
+                progname, path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    free(data);
+
+    /* the first interrupt is passed on, so that the run reports what
+     * it has got; the second one ends the client */
+    client_fd = fd;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_client_signal;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    (void) sigaction(SIGINT, &sa, NULL);
+    (void) sigaction(SIGTERM, &sa, NULL);
+
+    if (serve_read(fd, &code, sizeof(code)) == -1) {
+        fprintf(stderr, "%s: server %s: connection lost\n", progname, path);
+        return EXIT_FAILURE;
+    }
+    (void) close(fd);
+    return code;
 }
 
 /*
@@ -1251,49 +7751,105 @@ main(int argc, char *argv[])
     char *def_ports[] = { "80", 0 };
     char **usr_ports = NULL;
     char **ports = def_ports;
-
-    curl_global_init(CURL_GLOBAL_SSL);
-    CURL *curl;
-    curl = curl_easy_init();
-    if(curl)
-    {
-        CURLcode res;
-        curl_easy_setopt(curl, CURLOPT_URL, "https://www.google.com");
-        curl_easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2);  /*Set the TLS version CURL_SSLVERSION_TLSv1_3 is the newest*/
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data); 
-        res = curl_easy_perform(curl);
-        if(res == CURLE_OK)
-        {
-            double connect_dns, connect_tcp, connect_tls;
-            res = curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &connect_dns);
-            if(CURLE_OK == res) 
-            {
-                printf("\nTime it takes to do DNS: %.6f s\n", connect_dns);
-                res = curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect_tcp);
-                if(CURLE_OK == res) 
-                {
-                    printf("\nTime it takes to do only TCP: %.6f s\n", connect_tcp - connect_dns);
-                    res = curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &connect_tls);
-                    if(CURLE_OK == res) 
-                    {
-                        printf("\nTime it takes to do TCP + TLS: %.6f s\n", connect_tls - connect_dns);
-                    }
-                }
-            }
-            else
-            {
-                printf("\nUnsupported option.\n");
-            }
-        }
-        else
-        {
-            printf("Couldn't connect to google :( \n");
-        }
-        curl_easy_cleanup(curl);
+    char *rfile = NULL;
+    char *shm_name = NULL;
+    struct { char *name; char **ports; } *files = NULL;
+    int nfiles = 0;
+    int resuming = 0;
+    int64_t start;
+
+    trace_t0 = now_us();
+    atexit(diag_exit);
+    signals_begin();
+
+    /* -z and -Z come first and take all of the command line */
+    if (argc >= 3 && strcmp(argv[1], "-z") == 0) {
+	return client(argv[2], argc - 3, argv + 3);
     }
-    
-    while ((c = getopt(argc, argv, "abced:p:q:f:hmst:")) != -1) {
+    if (argc == 3 && strcmp(argv[1], "-Z") == 0) {
+	serve(argv[2], &argc, &argv);
+	trace_t0 = now_us();
+    }
+    srandom(getpid() ^ trace_t0);
+
+    while ((c = getopt(argc, argv, "A:B:C:D:E:F:G:HJ:K:L:M:PRS:T:UW:X:abced:i:j:k:p:q:f:hmo:r:st:w:")) != -1) {
 	switch (c) {
+	case 'A':
+	    if (append_fd != -1) {
+		(void) close(append_fd);
+	    }
+	    append_fd = open(optarg, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	    if (append_fd == -1) {
+		fprintf(stderr, "%s: open: %s\n",
+			progname, strerror(errno));
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'B':
+	    sched_parse(optarg);
+	    break;
+	case 'C':
+	    ctl_listen(optarg);
+	    break;
+	case 'D':
+	    shard_lfd = shard_socket(optarg, 1);
+	    break;
+	case 'E':
+	    health_parse(optarg);
+	    break;
+	case 'J':
+	    shard_fd = shard_socket(optarg, 0);
+	    break;
+	case 'K':
+	    shift_parse(optarg);
+	    break;
+	case 'F':
+	    sample_parse(optarg);
+	    break;
+	case 'G':
+	    coord_open(optarg);
+	    break;
+	case 'H':
+	    pc_open();
+	    prof_begin();
+	    break;
+	case 'L':
+	    diag_open(optarg);
+	    break;
+	case 'M':
+	    metrics_listen(optarg);
+	    break;
+	case 'P':
+	    prof_begin();
+	    break;
+	case 'R':
+	    resuming = 1;
+	    break;
+	case 'U':
+	    umode = 1;
+	    break;
+	case 'S':
+	    shm_name = optarg;
+	    break;
+	case 'T':
+	    trace_open(optarg);
+	    break;
+	case 'W':
+	    {
+	        char *endptr;
+		long num = strtol(optarg, &endptr, 10);
+		if (num > 0 && *endptr == '\0') {
+		    append_batch = num;
+		} else {
+		    fprintf(stderr, "%s: invalid argument '%s' "
+			    "for option -W\n", progname, optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    }
+	    break;
+	case 'X':
+	    cache_open(optarg);
+	    break;
 	case 'a':
 	    dmode = 1;
 	    break;
@@ -1316,11 +7872,40 @@ main(int argc, char *argv[])
 		}
 	    }
 	    break;
+	case 'i':
+	    {
+	        char *endptr;
+		long num = strtol(optarg, &endptr, 10);
+		if (num > 0 && num <= INT_MAX && *endptr == '\0') {
+		    interval = num;
+		} else {
+		    fprintf(stderr, "%s: invalid argument '%s' "
+			    "for option -i\n", progname, optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    }
+	    break;
+	case 'j':
+	    {
+	        char *endptr;
+		long num = strtol(optarg, &endptr, 10);
+		if (num >= 0 && num <= INT_MAX && *endptr == '\0') {
+		    jitter = num;
+		} else {
+		    fprintf(stderr, "%s: invalid argument '%s' "
+			    "for option -j\n", progname, optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    }
+	    break;
 	//Google Quic extension
 	case 'e':
 	    qmode = 1;
 	    printf("Quic should be measured too in the future\n");
 	    break;
+	case 'k':
+	    ckpt_file = optarg;
+	    break;
 	case 'p':
 	    if (! usr_ports) {
 		usr_ports = xcalloc(argc, sizeof(char *));
@@ -1342,11 +7927,24 @@ main(int argc, char *argv[])
 	    }
 	    break;
 	case 'f':
-	    import(optarg, ports);
+	    /* imported with the ports given so far once all options
+	     * are known, e.g. whether the names are to be resolved */
+	    files = xrealloc(files, (nfiles + 1) * sizeof(*files));
+	    files[nfiles].name = optarg;
+	    for (i = 0; ports[i]; i++) ;
+	    files[nfiles].ports = xcalloc(i + 1, sizeof(char *));
+	    memcpy(files[nfiles].ports, ports, i * sizeof(char *));
+	    nfiles++;
 	    break;
 	case 'm':
 	    skmode = 1;
 	    break;
+	case 'o':
+	    sink_load(optarg);
+	    break;
+	case 'r':
+	    rfile = optarg;
+	    break;
 	case 's':
 	    smode = 1;
 	    break;
@@ -1363,82 +7961,186 @@ main(int argc, char *argv[])
 		}
 	    }
 	    break;
+	case 'w':
+	    if (evlog) {
+		(void) fclose(evlog);
+	    }
+	    evlog = fopen(optarg, "w");
+	    if (! evlog) {
+		fprintf(stderr, "%s: fopen: %s\n",
+			progname, strerror(errno));
+		exit(EXIT_FAILURE);
+	    }
+	    break;
 	case 'h':
 	default: /* '?' */
 	    fprintf(stderr,
 		    "Usage: %s [-a] [-b] [-c] [-e] [-p port] [-q nqueries] "
 		    "[-t timeout] [-d delay ] [-f file] [-s] [-m] "
-		    "hostname...\n", progname);
+		    "[-i interval] [-j jitter] "
+		    "[-w file] [-r file] [-o sink[:arg]] [-A file] "
+		    "[-W size] [-S name] [-M [addr:]port] [-T file] "
+		    "[-L file] [-P] [-H] [-C path] [-E spec] [-K shift] "
+		    "[-k file [-R]] [-U] [-F percent] [-B rate] "
+		    "[-G name[:rate[:sockets]]] [-X file[:maxage]] "
+		    "[-D addr | -J addr] hostname...\n"
+		    "       %s -Z path\n"
+		    "       %s -z path [options] hostname...\n",
+		    progname, progname, progname);
 	    exit(EXIT_FAILURE);
 	}
     }
     argc -= optind;
     argv += optind;
 
+    for (i = 0; i < nfiles; i++) {
+	import(files[i].name, files[i].ports);
+	free(files[i].ports);
+    }
+    free(files);
+
     if (! cmode && ! pmode && ! dmode) {
 	cmode = 1;
     }
 
+    sink_begin();
+
+    if (resuming && ! ckpt_file) {
+	fprintf(stderr, "%s: option -R requires option -k\n", progname);
+	exit(EXIT_FAILURE);
+    }
+
+    if ((shard_lfd != -1 || shard_fd != -1)
+	&& ((shard_lfd != -1 && shard_fd != -1) || interval || rfile
+	    || ckpt_file || ctl_fd != -1)) {
+	fprintf(stderr, "%s: options -D and -J cannot be combined with "
+		"each other or with options -i, -r, -k and -C\n", progname);
+	exit(EXIT_FAILURE);
+    }
+
+    if (shard_lfd != -1 && evlog) {
+	fprintf(stderr, "%s: option -D cannot be combined with option -w, "
+		"the coordinator does not probe\n", progname);
+	exit(EXIT_FAILURE);
+    }
+
+    if (shard_fd != -1 && (argc || targets)) {
+	fprintf(stderr, "%s: option -J takes its targets from the "
+		"coordinator\n", progname);
+	exit(EXIT_FAILURE);
+    }
+
+    if (rfile) {
+	if (evlog || targets || argc || interval || ckpt_file) {
+	    fprintf(stderr, "%s: option -r cannot be combined with "
+		    "targets or options -w, -i and -k\n", progname);
+	    exit(EXIT_FAILURE);
+	}
+	replay(rfile);
+    } else if (! served) {
+	start = now_us();
+	prof_enter(PH_CURL);
+	curl_probe(stdout);
+	prof_leave();
+	post_span("curl probe", NULL, NULL, NULL, start, 0, 0);
+    } else {
+	fwrite(curl_text, 1, curl_len, stdout);
+    }
+
+    if (resuming) {
+	resuming = resume();
+    }
+
     for (i = 0; i < argc; i++) {
         for (j = 0; ports[j]; j++) {
+	    /* resumed targets keep their endpoints and results */
+	    if (resuming && lookup(argv[i], ports[j])) {
+		continue;
+	    }
             append(expand(argv[i], ports[j]));
         }
     }
 
-    if (targets) {
-	if (smode || pmode) {
-	    for (i = 0; i < nqueries; i++) {
-		prepare(targets);
-		collect(targets);
-	    }
-	}
-	if (smode) {
-	    sort(targets);
+    if (ctl_fd != -1 && ! interval) {
+	fprintf(stderr, "%s: option -C requires option -i\n", progname);
+	exit(EXIT_FAILURE);
+    }
+
+    if ((rate || classes) && ! interval) {
+	fprintf(stderr, "%s: option -B and target intervals "
+		"require option -i\n", progname);
+	exit(EXIT_FAILURE);
+    }
+
+    if ((rate || classes) && fraction) {
+	fprintf(stderr, "%s: option -F cannot be combined with "
+		"option -B or target intervals\n", progname);
+	exit(EXIT_FAILURE);
+    }
+
+    if (targets || ctl_fd != -1 || shard_fd != -1) {
+	trace_begin(targets);
+	diag_begin(targets);
+	if (! rfile) {
+	    evlog_begin(targets);
 	}
-	if (pmode) {
-	    pump(targets);
+	if (! rfile && (smode || pmode)) {
+	    if (shm_name) {
+		live_begin(shm_name, targets);
+	    }
+	    metrics_begin(targets);
+	    writer_start();
 	}
-	//Quic
-	if(qmode)
-	{
-		printf("Quic here\n");//TODO quic connection etablieren
+	start = now_us();
+	if (shard_lfd != -1) {
+	    shard_serve(targets);
+	} else if (shard_fd != -1) {
+	    shard_work();
+	} else if (rounds_done < nqueries || ! interval) {
+	    /* a resumed run that is complete is only reported again,
+	     * unless we run continuously and go on with the next run */
+	    run(targets, ! rfile && rounds_done < nqueries);
 	}
-	lock(stdout);
-	if (dmode) {
-	    if (skmode) {
-		report_dns_sk(targets);
-	    } else {
-		report_dns(targets);
+	while (interval && ! stopping) {
+	    start += interval * 1000LL;
+	    if (jitter) {
+		start += random() % (jitter + 1) * 1000LL;
 	    }
-	}
-	if (cmode) {
-	    if (skmode) {
-		report_sk(targets);
-	    } else {
-		if (dmode) {
-		    printf("\n");
-		}
-		report(targets);
+	    idle(start);
+	    if (stopping) {
+		break;
 	    }
+	    start = now_us();
+	    reset(targets);
+	    run(targets, 1);
 	}
-	if (pmode) {
-	    if (skmode) {
-		report_pump_sk(targets);
-	    } else {
-		if (cmode) {
-		    printf("\n");
-		}
-		report_pump(targets);
-	    }
+	/* a graceful stop after all rounds of a run keeps that run,
+	 * not the last periodic checkpoint */
+	if (interval && stopping && rounds_done == nqueries) {
+	    checkpoint(targets, 1);
+	}
+	writer_stop();
+	live_end();
+	evlog_end();
+	sink_end();
+	prof_report(stderr);
+	pc_report(stderr);
+	trace_end();
+	if (targets) {
+	    cleanup(targets);
 	}
-	unlock(stdout);
-	cleanup(targets);
     }
+    ctl_end();
+    coord_end();
 
     if (usr_ports) {
         (void) free(usr_ports);
     }
 
+    if (append_fd != -1) {
+        (void) close(append_fd);
+    }
+
     curl_global_cleanup();
     
     return EXIT_SUCCESS;